@@ -1,6 +1,8 @@
 #include "Triangle.hpp"
 #include "rasterizer.hpp"
+#include <chrono>
 #include <eigen3/Eigen/Eigen>
+#include <fstream>
 #include <iostream>
 #include <opencv2/opencv.hpp>
 
@@ -91,7 +93,16 @@ int main(int argc, const char** argv)
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc >= 3) {
+    // Headless mode: Rasterizer --benchmark [frames] [output.json]
+    bool benchmark = argc >= 2 && std::string(argv[1]) == "--benchmark";
+    int frames = 100;
+    if (benchmark && argc >= 3 && !parse_frame_count(argv[2], frames)) {
+        std::cerr << "Invalid frame count " << argv[2] << "\n"
+                  << "Usage: Rasterizer --benchmark [frames] [output.json]\n";
+        return 1;
+    }
+
+    if (argc >= 3 && !benchmark) {
         command_line = true;
         angle = std::stof(argv[2]); // -r by default
         if (argc == 4) {
@@ -115,6 +126,33 @@ int main(int argc, const char** argv)
     int key = 0;
     int frame_count = 0;
 
+    if (benchmark) {
+        benchmark_report report("Assignment1");
+        report.begin_run("wireframe");
+
+        // One full turn of the triangle over the run.
+        for (int frame = 0; frame < frames; ++frame) {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+
+            r.set_model(get_model_matrix(360.0f * frame / frames));
+            r.set_view(get_view_matrix(eye_pos));
+            r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
+
+            auto start = std::chrono::steady_clock::now();
+            r.draw(pos_id, ind_id, rst::Primitive::Triangle);
+            report.add_frame(elapsed_ms(start), r.timings());
+        }
+
+        if (argc >= 4) {
+            std::ofstream out(argv[3]);
+            report.write_json(out);
+        }
+        else {
+            report.write_json(std::cout);
+        }
+        return 0;
+    }
+
     if (command_line) {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
 
@@ -144,10 +144,13 @@ void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffe
     float f1 = (100 - 0.1) / 2.0;
     float f2 = (100 + 0.1) / 2.0;
 
+    auto start = std::chrono::steady_clock::now();
     Eigen::Matrix4f mvp = projection * view * model;
-    for (auto& i : ind)
+    std::vector<Triangle> triangles(ind.size());
+    for (size_t n = 0; n < ind.size(); ++n)
     {
-        Triangle t;
+        const Eigen::Vector3i& i = ind[n];
+        Triangle& t = triangles[n];
 
         Eigen::Vector4f v[] = {
                 mvp * to_vec4(buf[i[0]], 1.0f),
@@ -176,9 +179,16 @@ void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffe
         t.setColor(0, 255.0,  0.0,  0.0);
         t.setColor(1, 0.0  ,255.0,  0.0);
         t.setColor(2, 0.0  ,  0.0,255.0);
+    }
+    frame_timings.vertex += elapsed_ms(start);
+    frame_timings.triangles += (long long) ind.size();
 
+    start = std::chrono::steady_clock::now();
+    for (const auto& t : triangles)
+    {
         rasterize_wireframe(t);
     }
+    frame_timings.raster += elapsed_ms(start);
 }
 
 void rst::rasterizer::rasterize_wireframe(const Triangle& t)
@@ -212,6 +222,7 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        frame_timings = stage_timings();
     }
 }
 
@@ -233,5 +244,6 @@ void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vecto
         point.y() < 0 || point.y() >= height) return;
     auto ind = (height-point.y())*width + point.x();
     frame_buf[ind] = color;
+    ++frame_timings.fragments;
 }
 
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "Triangle.hpp"
+#include "benchmark.hpp"
 #include <algorithm>
 #include <eigen3/Eigen/Eigen>
 using namespace Eigen;
@@ -66,6 +67,10 @@ class rasterizer
 
     std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
+    // Stage timings since the depth buffer was last cleared. Wireframe drawing has vertex and
+    // raster stages only; fragments counts the pixels written by the lines.
+    const stage_timings& timings() const { return frame_timings; }
+
   private:
     void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
     void rasterize_wireframe(const Triangle& t);
@@ -84,6 +89,8 @@ class rasterizer
 
     int width, height;
 
+    stage_timings frame_timings;
+
     int next_id = 0;
     int get_next_id() { return next_id++; }
 };
@@ -0,0 +1,137 @@
+//
+// Per-stage frame timings and the report of the headless benchmark mode.
+//
+
+#ifndef RASTERIZER_BENCHMARK_H
+#define RASTERIZER_BENCHMARK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Wall time spent in each pipeline stage in milliseconds, and the work done, accumulated by
+// the rasterizer until the depth buffer is cleared. Stages a rasterizer does not have stay 0.
+struct stage_timings
+{
+    double vertex = 0;  // vertex processing and transforms
+    double setup = 0;   // primitive assembly and triangle setup
+    double raster = 0;  // coverage and depth tests, plus shading when it is not deferred
+    double shade = 0;   // deferred fragment shading
+    double resolve = 0; // multisample resolve
+    long long triangles = 0;
+    long long fragments = 0;
+};
+
+inline double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Frame count argument of --benchmark. False unless all of arg is a positive integer.
+inline bool parse_frame_count(const std::string& arg, int& frames)
+{
+    try
+    {
+        size_t end = 0;
+        int value = std::stoi(arg, &end);
+        if (end != arg.size() || value <= 0)
+        {
+            return false;
+        }
+        frames = value;
+        return true;
+    }
+    catch (const std::logic_error&)
+    {
+        return false;
+    }
+}
+
+// Frames of one or more benchmark runs (e.g. one per shader), summarized as min/median/p99
+// per stage plus throughput and written as JSON.
+class benchmark_report
+{
+public:
+    explicit benchmark_report(std::string name) : name(std::move(name)) {}
+
+    void begin_run(const std::string& run_name) { runs.push_back({run_name, {}, {}}); }
+
+    void add_frame(double frame_ms, const stage_timings& timings)
+    {
+        runs.back().frame_ms.push_back(frame_ms);
+        runs.back().stages.push_back(timings);
+    }
+
+    void write_json(std::ostream& out) const
+    {
+        out << "{\n  \"benchmark\": \"" << name << "\",\n  \"runs\": [";
+        for (size_t i = 0; i < runs.size(); ++i)
+        {
+            const run& r = runs[i];
+            double total_ms = 0;
+            long long triangles = 0, fragments = 0;
+            std::vector<double> stage[5];
+            for (size_t f = 0; f < r.frame_ms.size(); ++f)
+            {
+                const stage_timings& t = r.stages[f];
+                total_ms += r.frame_ms[f];
+                triangles += t.triangles;
+                fragments += t.fragments;
+                stage[0].push_back(t.vertex);
+                stage[1].push_back(t.setup);
+                stage[2].push_back(t.raster);
+                stage[3].push_back(t.shade);
+                stage[4].push_back(t.resolve);
+            }
+            double seconds = total_ms > 0 ? total_ms / 1000.0 : 1.0;
+
+            out << (i ? ",\n" : "\n") << "    {\n";
+            out << "      \"name\": \"" << r.name << "\",\n";
+            out << "      \"frames\": " << r.frame_ms.size() << ",\n";
+            out << "      \"frame_ms\": " << summary(r.frame_ms) << ",\n";
+            out << "      \"vertex_ms\": " << summary(stage[0]) << ",\n";
+            out << "      \"setup_ms\": " << summary(stage[1]) << ",\n";
+            out << "      \"raster_ms\": " << summary(stage[2]) << ",\n";
+            out << "      \"shade_ms\": " << summary(stage[3]) << ",\n";
+            out << "      \"resolve_ms\": " << summary(stage[4]) << ",\n";
+            out << "      \"triangles_per_s\": " << triangles / seconds << ",\n";
+            out << "      \"fragments_per_s\": " << fragments / seconds << "\n";
+            out << "    }";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    struct run
+    {
+        std::string name;
+        std::vector<double> frame_ms;
+        std::vector<stage_timings> stages;
+    };
+
+    // Nearest-rank percentiles.
+    static std::string summary(std::vector<double> values)
+    {
+        if (values.empty())
+        {
+            return "null";
+        }
+        std::sort(values.begin(), values.end());
+        auto percentile = [&](double p) {
+            size_t rank = (size_t) std::ceil(p * values.size());
+            return values[std::min(std::max(rank, (size_t) 1), values.size()) - 1];
+        };
+        return "{\"min\": " + std::to_string(values.front()) + ", \"median\": " + std::to_string(percentile(0.5)) +
+               ", \"p99\": " + std::to_string(percentile(0.99)) + "}";
+    }
+
+    std::string name;
+    std::vector<run> runs;
+};
+
+#endif //RASTERIZER_BENCHMARK_H
@@ -1,4 +1,6 @@
 // clang-format off
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include "rasterizer.hpp"
@@ -25,6 +27,15 @@ Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
 Eigen::Matrix4f get_model_matrix(float rotation_angle)
 {
     Eigen::Matrix4f model = Eigen::Matrix4f::Identity();
+
+    // Rotation around the Z axis, used by the benchmark sweep.
+    float fCos = std::cos(rotation_angle / 180.0f * (float)MY_PI);
+    float fSin = std::sin(rotation_angle / 180.0f * (float)MY_PI);
+    model << fCos, -fSin, 0, 0,
+             fSin,  fCos, 0, 0,
+             0,     0,    1, 0,
+             0,     0,    0, 1;
+
     return model;
 }
 
@@ -61,7 +72,17 @@ int main(int argc, const char** argv)
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc == 2)
+    // Headless mode: Rasterizer --benchmark [frames] [output.json]
+    bool benchmark = argc >= 2 && std::string(argv[1]) == "--benchmark";
+    int frames = 100;
+    if (benchmark && argc >= 3 && !parse_frame_count(argv[2], frames))
+    {
+        std::cerr << "Invalid frame count " << argv[2] << "\n"
+                  << "Usage: Rasterizer --benchmark [frames] [output.json]\n";
+        return 1;
+    }
+
+    if (argc >= 2 && !benchmark)
     {
         command_line = true;
         filename = std::string(argv[1]);
@@ -69,6 +90,12 @@ int main(int argc, const char** argv)
 
     rst::rasterizer r(700, 700);
 
+    // Optional MSAA sample count: 1, 2, 4 or 8.
+    if (argc >= 3 && !benchmark)
+    {
+        r.set_msaa(std::stoi(argv[2]));
+    }
+
     Eigen::Vector3f eye_pos = {0,0,5};
 
 
@@ -105,6 +132,41 @@ int main(int argc, const char** argv)
     int key = 0;
     int frame_count = 0;
 
+    if (benchmark)
+    {
+        benchmark_report report("Assignment2");
+        for (int samples : {1, 2, 4, 8})
+        {
+            r.set_msaa(samples);
+            report.begin_run("msaa" + std::to_string(samples));
+
+            // Every run sweeps one full turn of the triangles.
+            for (int frame = 0; frame < frames; ++frame)
+            {
+                r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                r.set_model(get_model_matrix(360.0f * frame / frames));
+                r.set_view(get_view_matrix(eye_pos));
+                r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
+
+                auto start = std::chrono::steady_clock::now();
+                r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+                r.frame_buffer();
+                report.add_frame(elapsed_ms(start), r.timings());
+            }
+        }
+
+        if (argc >= 4)
+        {
+            std::ofstream out(argv[3]);
+            report.write_json(out);
+        }
+        else
+        {
+            report.write_json(std::cout);
+        }
+        return 0;
+    }
+
     if (command_line)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
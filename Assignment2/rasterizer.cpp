@@ -40,29 +40,45 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 }
 
 
-static bool insideTriangle(int x, int y, const Vector3f* _v)
-{   
-    // check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
-    const Vector3f& v0 = _v[0], v1 = _v[1], v2 = _v[2];
-    Vector3f v0v1 = v1 - v0, v1v2 = v2 - v1;
-    Vector3f v((float)x, (float)y, 0);
-    Vector3f v0v = v - v0, v1v = v - v1;
-    float cp0 = v0v1.cross(v0v).z(), cp1 = v1v2.cross(v1v).z();
-    if (cp0 * cp1 < 0)
+// Edge equation E(x, y) = a * x + b * y + c of one triangle edge, oriented so that
+// points inside the triangle give E >= 0. E / area is the barycentric weight of the
+// vertex opposite to the edge.
+struct edge_equation
+{
+    float a, b, c;
+
+    float at(float x, float y) const { return a * x + b * y + c; }
+};
+
+struct triangle_edges
+{
+    edge_equation e[3];
+    float inv_area;
+};
+
+static bool setup_edges(const Vector3f* v, triangle_edges& edges)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vector3f& p = v[(i + 1) % 3];
+        const Vector3f& q = v[(i + 2) % 3];
+        edges.e[i] = {p.y() - q.y(), q.x() - p.x(), p.x() * q.y() - q.x() * p.y()};
+    }
+    float area = edges.e[0].at(v[0].x(), v[0].y());
+    if (area == 0 || !std::isfinite(area))
     {
         return false;
     }
-    Vector3f v2v0 = v0 - v2, v2v = v - v2;
-    float cp2 = v2v0.cross(v2v).z();
-    return cp0 * cp2 >= 0;
-}
-
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
-{
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+    if (area < 0)
+    {
+        for (auto& e : edges.e)
+        {
+            e = {-e.a, -e.b, -e.c};
+        }
+        area = -area;
+    }
+    edges.inv_area = 1.0f / area;
+    return true;
 }
 
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
@@ -74,10 +90,13 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
 
+    auto start = std::chrono::steady_clock::now();
     Eigen::Matrix4f mvp = projection * view * model;
-    for (auto& i : ind)
+    std::vector<Triangle> triangles(ind.size());
+    for (size_t n = 0; n < ind.size(); ++n)
     {
-        Triangle t;
+        const Eigen::Vector3i& i = ind[n];
+        Triangle& t = triangles[n];
         Eigen::Vector4f v[] = {
                 mvp * to_vec4(buf[i[0]], 1.0f),
                 mvp * to_vec4(buf[i[1]], 1.0f),
@@ -109,63 +128,161 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
         t.setColor(0, col_x[0], col_x[1], col_x[2]);
         t.setColor(1, col_y[0], col_y[1], col_y[2]);
         t.setColor(2, col_z[0], col_z[1], col_z[2]);
+    }
+    frame_timings.vertex += elapsed_ms(start);
+    frame_timings.triangles += (long long) ind.size();
 
+    for (const auto& t : triangles)
+    {
         rasterize_triangle(t);
     }
+    resolve_pending = true;
+}
+
+// Rotated-grid sample positions relative to the pixel center, in pixels.
+static const Vector2f* sample_pattern(int samples)
+{
+    static const Vector2f pattern1[] = {{0, 0}};
+    static const Vector2f pattern2[] = {{0.25f, 0.25f}, {-0.25f, -0.25f}};
+    static const Vector2f pattern4[] = {{-0.125f, -0.375f}, {0.375f, -0.125f}, {-0.375f, 0.125f}, {0.125f, 0.375f}};
+    static const Vector2f pattern8[] = {{0.0625f, -0.1875f}, {-0.0625f, 0.1875f}, {0.3125f, 0.0625f}, {-0.1875f, -0.3125f},
+                                        {-0.3125f, 0.3125f}, {-0.4375f, -0.0625f}, {0.1875f, 0.4375f}, {0.4375f, -0.4375f}};
+    switch (samples)
+    {
+        case 2: return pattern2;
+        case 4: return pattern4;
+        case 8: return pattern8;
+        default: return pattern1;
+    }
 }
 
 //Screen space rasterization
 void rst::rasterizer::rasterize_triangle(const Triangle& t)
 {
+    auto start = std::chrono::steady_clock::now();
     auto v = t.toVector4();
 
     // Find out the bounding box of current triangle.
-    // iterate through the pixel and find if the current pixel is inside the triangle
+    // iterate through the pixel and use the edge equations to find the covered samples
     const Vector3f &v0 = t.v[0], v1 = t.v[1], v2 = t.v[2];
     float xmin = std::min({v0.x(), v1.x(), v2.x()});
     float xmax = std::max({v0.x(), v1.x(), v2.x()});
     float ymin = std::min({v0.y(), v1.y(), v2.y()});
     float ymax = std::max({v0.y(), v1.y(), v2.y()});
-    for (int x = (int) std::round(xmin); x < (int) std::round(xmax); ++x)
+    triangle_edges edges;
+    if (!setup_edges(t.v, edges))
     {
-        for (int y = (int) std::round(ymin); y < (int) std::round(ymax); ++y)
+        frame_timings.setup += elapsed_ms(start);
+        return;
+    }
+
+    int x_begin = std::max((int) std::floor(xmin), 0), x_end = std::min((int) std::ceil(xmax), width);
+    int y_begin = std::max((int) std::floor(ymin), 0), y_end = std::min((int) std::ceil(ymax), height);
+
+    // Offset of every edge value at every sample from its value at the pixel center.
+    const Vector2f* pattern = sample_pattern(aa_count);
+    float sample_offset[8][3];
+    for (int i = 0; i < aa_count; ++i)
+    {
+        for (int k = 0; k < 3; ++k)
         {
-            const Vector3f& color = t.getColor();
-            float depth = std::numeric_limits<float>::infinity();
-            int aa_x_index[] = {0, 0, 1, 1}, aa_y_index[] = {0, 1, 0, 1};
+            sample_offset[i][k] = pattern[i].x() * edges.e[k].a + pattern[i].y() * edges.e[k].b;
+        }
+    }
+
+    frame_timings.setup += elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    const Vector3f& color = t.getColor();
+    for (int y = y_begin; y < y_end; ++y)
+    {
+        // Edge values at the center of the first pixel of the row; stepping one pixel in x adds e.a.
+        float center[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            center[k] = edges.e[k].at(x_begin + 0.5f, y + 0.5f);
+        }
+        for (int x = x_begin; x < x_end; ++x, center[0] += edges.e[0].a, center[1] += edges.e[1].a, center[2] += edges.e[2].a)
+        {
+            // Coverage mask of the pixel, with the edge values kept for the depth of each sample.
+            unsigned coverage = 0;
+            float w[8][3];
+            for (int i = 0; i < aa_count; ++i)
+            {
+                for (int k = 0; k < 3; ++k)
+                {
+                    w[i][k] = center[k] + sample_offset[i][k];
+                }
+                if (w[i][0] >= 0 && w[i][1] >= 0 && w[i][2] >= 0)
+                {
+                    coverage |= 1u << i;
+                }
+            }
+            if (!coverage)
+            {
+                continue;
+            }
+            ++frame_timings.fragments;
+
+            // The pixel is shaded once (the triangle color here) and the result is stored to
+            // every covered sample that passes the depth test.
             int aa_index = get_index(x, y) * aa_count;
             for (int i = 0; i < aa_count; ++i)
             {
-                float aa_x = x + aa_x_index[i], aa_y = y + aa_y_index[i];
-                if (!insideTriangle((int) aa_x, (int) aa_y, t.v))
+                if (!(coverage & (1u << i)))
                 {
                     continue;
                 }
 
                 // If so, use the following code to get the interpolated z value.
-                auto [alpha, beta, gamma] = computeBarycentric2D(aa_x, aa_y, t.v);
+                float alpha = w[i][0] * edges.inv_area, beta = w[i][1] * edges.inv_area, gamma = w[i][2] * edges.inv_area;
                 float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
                 float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
                 z_interpolated *= w_reciprocal;
 
-                // set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
                 if (-z_interpolated >= aa_depth_buf[aa_index + i])
                 {
                     continue;
                 }
-                depth = std::min(depth, -z_interpolated);
-                aa_depth_buf[aa_index + i] = depth;
-                aa_frame_buf[aa_index + i] = color / aa_count;
+                aa_depth_buf[aa_index + i] = -z_interpolated;
+                aa_frame_buf[aa_index + i] = color;
             }
+        }
+    }
+    frame_timings.raster += elapsed_ms(start);
+}
 
-            Vector3f aa_color{0, 0, 0};
-            for (int i = 0; i < aa_count; ++i)
-            {
-                aa_color += aa_frame_buf[aa_index + i];
-            }
-            set_pixel({x, y, depth}, aa_color);
+void rst::rasterizer::set_msaa(int samples)
+{
+    aa_count = samples >= 8 ? 8 : samples >= 4 ? 4 : samples >= 2 ? 2 : 1;
+    aa_frame_buf.assign(width * height * aa_count, Eigen::Vector3f{0, 0, 0});
+    aa_depth_buf.assign(width * height * aa_count, std::numeric_limits<float>::infinity());
+    std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+    std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+    resolve_pending = false;
+}
+
+void rst::rasterizer::resolve()
+{
+    if (!resolve_pending)
+    {
+        return;
+    }
+    resolve_pending = false;
+
+    auto start = std::chrono::steady_clock::now();
+    float weight = 1.0f / aa_count;
+    for (int index = 0; index < width * height; ++index)
+    {
+        const Eigen::Vector3f* samples = &aa_frame_buf[index * aa_count];
+        Eigen::Vector3f color = samples[0];
+        for (int i = 1; i < aa_count; ++i)
+        {
+            color += samples[i];
         }
+        frame_buf[index] = color * weight;
     }
+    frame_timings.resolve += elapsed_ms(start);
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -189,11 +306,13 @@ void rst::rasterizer::clear(rst::Buffers buff)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
         std::fill(aa_frame_buf.begin(), aa_frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        resolve_pending = false;
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
         std::fill(aa_depth_buf.begin(), aa_depth_buf.end(), std::numeric_limits<float>::infinity());
+        frame_timings = stage_timings();
     }
 }
 
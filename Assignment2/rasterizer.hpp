@@ -6,6 +6,7 @@
 
 #include <eigen3/Eigen/Eigen>
 #include <algorithm>
+#include "benchmark.hpp"
 #include "global.hpp"
 #include "Triangle.hpp"
 using namespace Eigen;
@@ -72,7 +73,18 @@ namespace rst
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Multisample anti-aliasing with 1, 2, 4 or 8 samples per pixel on a rotated grid
+        // (other counts round down). Every covered pixel is shaded once and the color is
+        // stored to the covered samples that pass the depth test; resolve() averages the
+        // samples into the frame buffer. Changing the count clears both buffers.
+        void set_msaa(int samples);
+        void resolve();
+
+        // Stage timings since the depth buffer was last cleared. The color of a triangle is
+        // produced during rasterization, so there is no separate shade stage.
+        const stage_timings& timings() const { return frame_timings; }
+
+        std::vector<Eigen::Vector3f>& frame_buffer() { resolve(); return frame_buf; }
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
@@ -97,6 +109,8 @@ namespace rst
         int aa_count = 4;
         std::vector<Eigen::Vector3f> aa_frame_buf;
         std::vector<float> aa_depth_buf;
+        bool resolve_pending = false;
+        stage_timings frame_timings;
 
         int get_index(int x, int y);
 
@@ -23,12 +23,36 @@ struct fragment_shader_payload
     Eigen::Vector3f color;
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
+    // Screen-space derivatives of tex_coords along x and y, for mip level selection.
+    Eigen::Vector2f tex_dx = {0, 0};
+    Eigen::Vector2f tex_dy = {0, 0};
     Texture* texture;
 };
 
+// Up to fragment_batch::size fragments in structure-of-arrays layout, shaded in one call by
+// the statically dispatched rst::rasterizer::draw<Shader>. The shader writes result.
+struct fragment_batch
+{
+    static constexpr int size = 8;
+
+    alignas(32) float view_pos[3][size];
+    alignas(32) float color[3][size];
+    alignas(32) float normal[3][size];
+    alignas(32) float tex_coords[2][size];
+    alignas(32) float tex_dx[2][size];
+    alignas(32) float tex_dy[2][size];
+    Texture* texture = nullptr;
+
+    alignas(32) float result[3][size];
+};
+
+// Input of the vertex stage, in object space. The vertex shader returns the object space
+// position that is then transformed to the screen.
 struct vertex_shader_payload
 {
     Eigen::Vector3f position;
+    Eigen::Vector3f normal;
+    Eigen::Vector2f tex_coords;
 };
 
 #endif //RASTERIZER_SHADER_H
@@ -7,9 +7,63 @@
 #include "global.hpp"
 #include <eigen3/Eigen/Eigen>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 class Texture{
 private:
     cv::Mat image_data;
+    // Mip chain: level 0 is image_data, every further level is a 2x2 box filter of the
+    // previous one, down to 1x1.
+    std::vector<cv::Mat> mip_levels;
+
+    static cv::Mat downsample(const cv::Mat& src)
+    {
+        int w = std::max(1, src.cols / 2), h = std::max(1, src.rows / 2);
+        cv::Mat dst(h, w, CV_8UC3);
+        for (int y = 0; y < h; ++y)
+        {
+            int y0 = std::min(2 * y, src.rows - 1), y1 = std::min(2 * y + 1, src.rows - 1);
+            for (int x = 0; x < w; ++x)
+            {
+                int x0 = std::min(2 * x, src.cols - 1), x1 = std::min(2 * x + 1, src.cols - 1);
+                const auto& c00 = src.at<cv::Vec3b>(y0, x0);
+                const auto& c10 = src.at<cv::Vec3b>(y0, x1);
+                const auto& c01 = src.at<cv::Vec3b>(y1, x0);
+                const auto& c11 = src.at<cv::Vec3b>(y1, x1);
+                auto& c = dst.at<cv::Vec3b>(y, x);
+                for (int k = 0; k < 3; ++k)
+                {
+                    c[k] = (unsigned char) ((c00[k] + c10[k] + c01[k] + c11[k] + 2) / 4);
+                }
+            }
+        }
+        return dst;
+    }
+
+    // Bilinear filter between the four texel centers around (u, v), clamped to the edges.
+    static Eigen::Vector3f sample_level(const cv::Mat& level, float u, float v)
+    {
+        float x = std::clamp(u, 0.0f, 1.0f) * level.cols - 0.5f;
+        float y = (1.0f - std::clamp(v, 0.0f, 1.0f)) * level.rows - 0.5f;
+        float fx = std::floor(x), fy = std::floor(y);
+        float s = x - fx, t = y - fy;
+        int x0 = std::clamp((int) fx, 0, level.cols - 1), x1 = std::clamp((int) fx + 1, 0, level.cols - 1);
+        int y0 = std::clamp((int) fy, 0, level.rows - 1), y1 = std::clamp((int) fy + 1, 0, level.rows - 1);
+
+        const auto& c00 = level.at<cv::Vec3b>(y0, x0);
+        const auto& c10 = level.at<cv::Vec3b>(y0, x1);
+        const auto& c01 = level.at<cv::Vec3b>(y1, x0);
+        const auto& c11 = level.at<cv::Vec3b>(y1, x1);
+        Eigen::Vector3f color;
+        for (int k = 0; k < 3; ++k)
+        {
+            float top = c00[k] + s * (c10[k] - c00[k]);
+            float bottom = c01[k] + s * (c11[k] - c01[k]);
+            color[k] = top + t * (bottom - top);
+        }
+        return color;
+    }
 
 public:
     Texture(const std::string& name)
@@ -18,6 +72,12 @@ public:
         cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
         width = image_data.cols;
         height = image_data.rows;
+
+        mip_levels.push_back(image_data);
+        while (mip_levels.back().cols > 1 || mip_levels.back().rows > 1)
+        {
+            mip_levels.push_back(downsample(mip_levels.back()));
+        }
     }
 
     int width, height;
@@ -61,5 +121,38 @@ public:
         return {color[0], color[1], color[2]};
     }
 
+    int mip_count() const { return (int) mip_levels.size(); }
+
+    // Level of detail for a pixel footprint given the screen-space derivatives of (u, v):
+    // log2 of the longer footprint axis measured in level 0 texels.
+    float getLevel(const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const
+    {
+        float dx = Eigen::Vector2f(duv_dx.x() * width, duv_dx.y() * height).squaredNorm();
+        float dy = Eigen::Vector2f(duv_dy.x() * width, duv_dy.y() * height).squaredNorm();
+        float rho_sqr = std::max(dx, dy);
+        if (!(rho_sqr > 1.0f))
+        {
+            return 0.0f;
+        }
+        return std::min(0.5f * std::log2(rho_sqr), (float) (mip_levels.size() - 1));
+    }
+
+    // Trilinear filtering: bilinear lookups in the two mip levels around the level of detail
+    // of the footprint, blended linearly.
+    Eigen::Vector3f getColorTrilinear(float u, float v, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const
+    {
+        float level = getLevel(duv_dx, duv_dy);
+        int fine = (int) level;
+        int coarse = std::min(fine + 1, (int) mip_levels.size() - 1);
+        float t = level - fine;
+
+        Eigen::Vector3f color = sample_level(mip_levels[fine], u, v);
+        if (t > 0.0f && coarse != fine)
+        {
+            color += t * (sample_level(mip_levels[coarse], u, v) - color);
+        }
+        return color;
+    }
+
 };
 #endif //RASTERIZER_TEXTURE_H
@@ -1,4 +1,8 @@
+#include <array>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -105,7 +109,7 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     if (payload.texture)
     {
         const Eigen::Vector2f& tex_coords = payload.tex_coords;
-        return_color = payload.texture->getColorBilinear(tex_coords.x(), tex_coords.y());
+        return_color = payload.texture->getColorTrilinear(tex_coords.x(), tex_coords.y(), payload.tex_dx, payload.tex_dy);
     }
     Eigen::Vector3f texture_color;
     texture_color << return_color.x(), return_color.y(), return_color.z();
@@ -326,9 +330,196 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     return result_color * 255.f;
 }
 
+// Batched ports of the shaders above for rst::rasterizer::draw<Shader>. Every lane loop works
+// on plain floats in structure-of-arrays form so it can be inlined and vectorized.
+
+// x^n by repeated squaring, which keeps the lane loops free of libm calls.
+static inline float pow_n(float x, int n)
+{
+    float result = 1.0f;
+    for (; n > 0; n >>= 1)
+    {
+        if (n & 1)
+        {
+            result *= x;
+        }
+        x *= x;
+    }
+    return result;
+}
+
+// Blinn-Phong with the two scene lights for one lane; kd, point and normal are per lane.
+static inline void blinn_phong(const float kd[3], const float point[3], const float normal[3], float result[3])
+{
+    constexpr float light_pos[2][3] = {{20, 20, 20}, {-20, 20, 0}};
+    constexpr float light_intensity = 500;
+    constexpr float ambient = 0.005f * 10;
+    constexpr float ks = 0.7937f;
+    constexpr float eye_pos[3] = {0, 0, 10};
+    constexpr int p = 150;
+
+    float r = 0, g = 0, b = 0;
+    for (const auto& light : light_pos)
+    {
+        float l[3] = {light[0] - point[0], light[1] - point[1], light[2] - point[2]};
+        float r_sqr = l[0] * l[0] + l[1] * l[1] + l[2] * l[2];
+        float I = light_intensity / r_sqr;
+        float n_dot_l = (normal[0] * l[0] + normal[1] * l[1] + normal[2] * l[2]) / std::sqrt(r_sqr);
+
+        float h[3] = {l[0] + eye_pos[0] - point[0], l[1] + eye_pos[1] - point[1], l[2] + eye_pos[2] - point[2]};
+        float h_len = std::sqrt(h[0] * h[0] + h[1] * h[1] + h[2] * h[2]);
+        float n_dot_h = (normal[0] * h[0] + normal[1] * h[1] + normal[2] * h[2]) / h_len;
+
+        float diffuse = I * std::max(0.0f, n_dot_l);
+        float specular = ks * I * pow_n(std::max(0.0f, n_dot_h), p);
+        r += ambient + kd[0] * diffuse + specular;
+        g += ambient + kd[1] * diffuse + specular;
+        b += ambient + kd[2] * diffuse + specular;
+    }
+    result[0] = r * 255.f;
+    result[1] = g * 255.f;
+    result[2] = b * 255.f;
+}
+
+// Height-map tangent frame shared by the bump and displacement shaders. Returns the
+// perturbed normal and the height h(u, v) of one lane.
+static inline float perturb_normal(Texture* texture, float u, float v, const float n[3], float normal[3])
+{
+    float kh = 0.2, kn = 0.1;
+    float x = n[0], y = n[1], z = n[2];
+    float factor = std::sqrt(x * x + z * z);
+    float t[3] = {x * y / factor, factor, z * y / factor};
+    float b[3] = {n[1] * t[2] - n[2] * t[1], n[2] * t[0] - n[0] * t[2], n[0] * t[1] - n[1] * t[0]};
+
+    float w = (float) texture->width, h = (float) texture->height;
+    float height = texture->getColor(u, v).norm();
+    float dU = kh * kn * (texture->getColor(u + 1.0f / w, v).norm() - height);
+    float dV = kh * kn * (texture->getColor(u, v + 1.0f / h).norm() - height);
+    for (int k = 0; k < 3; ++k)
+    {
+        normal[k] = -dU * t[k] - dV * b[k] + n[k];
+    }
+    return height;
+}
+
+struct normal_batch_shader
+{
+    void operator()(fragment_batch& batch) const
+    {
+        for (int i = 0; i < fragment_batch::size; ++i)
+        {
+            float x = batch.normal[0][i], y = batch.normal[1][i], z = batch.normal[2][i];
+            float inv_len = 1.0f / std::sqrt(x * x + y * y + z * z);
+            batch.result[0][i] = (x * inv_len + 1.0f) / 2.f * 255;
+            batch.result[1][i] = (y * inv_len + 1.0f) / 2.f * 255;
+            batch.result[2][i] = (z * inv_len + 1.0f) / 2.f * 255;
+        }
+    }
+};
+
+struct phong_batch_shader
+{
+    void operator()(fragment_batch& batch) const
+    {
+        for (int i = 0; i < fragment_batch::size; ++i)
+        {
+            float x = batch.normal[0][i], y = batch.normal[1][i], z = batch.normal[2][i];
+            float inv_len = 1.0f / std::sqrt(x * x + y * y + z * z);
+            float normal[3] = {x * inv_len, y * inv_len, z * inv_len};
+            float kd[3] = {batch.color[0][i], batch.color[1][i], batch.color[2][i]};
+            float point[3] = {batch.view_pos[0][i], batch.view_pos[1][i], batch.view_pos[2][i]};
+            float result[3];
+            blinn_phong(kd, point, normal, result);
+            batch.result[0][i] = result[0];
+            batch.result[1][i] = result[1];
+            batch.result[2][i] = result[2];
+        }
+    }
+};
+
+struct texture_batch_shader
+{
+    void operator()(fragment_batch& batch) const
+    {
+        float kd[3][fragment_batch::size] = {};
+        if (batch.texture)
+        {
+            for (int i = 0; i < fragment_batch::size; ++i)
+            {
+                Eigen::Vector2f duv_dx = {batch.tex_dx[0][i], batch.tex_dx[1][i]};
+                Eigen::Vector2f duv_dy = {batch.tex_dy[0][i], batch.tex_dy[1][i]};
+                Eigen::Vector3f texture_color = batch.texture->getColorTrilinear(batch.tex_coords[0][i], batch.tex_coords[1][i], duv_dx, duv_dy);
+                kd[0][i] = texture_color.x() / 255.f;
+                kd[1][i] = texture_color.y() / 255.f;
+                kd[2][i] = texture_color.z() / 255.f;
+            }
+        }
+
+        for (int i = 0; i < fragment_batch::size; ++i)
+        {
+            float lane_kd[3] = {kd[0][i], kd[1][i], kd[2][i]};
+            float point[3] = {batch.view_pos[0][i], batch.view_pos[1][i], batch.view_pos[2][i]};
+            float normal[3] = {batch.normal[0][i], batch.normal[1][i], batch.normal[2][i]};
+            float result[3];
+            blinn_phong(lane_kd, point, normal, result);
+            batch.result[0][i] = result[0];
+            batch.result[1][i] = result[1];
+            batch.result[2][i] = result[2];
+        }
+    }
+};
+
+struct bump_batch_shader
+{
+    void operator()(fragment_batch& batch) const
+    {
+        for (int i = 0; i < fragment_batch::size; ++i)
+        {
+            float normal[3] = {0, 0, 0};
+            if (batch.texture)
+            {
+                float n[3] = {batch.normal[0][i], batch.normal[1][i], batch.normal[2][i]};
+                perturb_normal(batch.texture, batch.tex_coords[0][i], batch.tex_coords[1][i], n, normal);
+            }
+            batch.result[0][i] = normal[0] * 255.f;
+            batch.result[1][i] = normal[1] * 255.f;
+            batch.result[2][i] = normal[2] * 255.f;
+        }
+    }
+};
+
+struct displacement_batch_shader
+{
+    void operator()(fragment_batch& batch) const
+    {
+        for (int i = 0; i < fragment_batch::size; ++i)
+        {
+            float result[3] = {0, 0, 0};
+            if (batch.texture)
+            {
+                float kn = 0.1;
+                float n[3] = {batch.normal[0][i], batch.normal[1][i], batch.normal[2][i]};
+                float normal[3];
+                float height = perturb_normal(batch.texture, batch.tex_coords[0][i], batch.tex_coords[1][i], n, normal);
+                float point[3];
+                for (int k = 0; k < 3; ++k)
+                {
+                    point[k] = batch.view_pos[k][i] + kn * n[k] * height;
+                }
+                float kd[3] = {batch.color[0][i], batch.color[1][i], batch.color[2][i]};
+                blinn_phong(kd, point, normal, result);
+            }
+            batch.result[0][i] = result[0];
+            batch.result[1][i] = result[1];
+            batch.result[2][i] = result[2];
+        }
+    }
+};
+
 int main(int argc, const char** argv)
 {
-    std::vector<Triangle*> TriangleList;
+    std::vector<rst::vertex> vertices;
+    std::vector<Eigen::Vector3i> indices;
 
     float angle = 140.0;
     bool command_line = false;
@@ -339,60 +530,96 @@ int main(int argc, const char** argv)
 
     // Load .obj File
     bool loadout = Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
+    // The loader emits three vertices per face; identical ones are merged so that the
+    // rasterizer transforms every shared vertex once.
+    std::map<std::array<float, 8>, int> vertex_index;
     for(auto mesh:Loader.LoadedMeshes)
     {
         for(int i=0;i<mesh.Vertices.size();i+=3)
         {
-            Triangle* t = new Triangle();
+            Eigen::Vector3i face;
             for(int j=0;j<3;j++)
             {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
+                const auto& v = mesh.Vertices[i+j];
+                std::array<float, 8> key = {v.Position.X, v.Position.Y, v.Position.Z, v.Normal.X, v.Normal.Y, v.Normal.Z,
+                                            v.TextureCoordinate.X, v.TextureCoordinate.Y};
+                auto found = vertex_index.emplace(key, (int) vertices.size());
+                if (found.second)
+                {
+                    vertices.push_back({Vector3f(v.Position.X, v.Position.Y, v.Position.Z),
+                                        Vector3f(v.Normal.X, v.Normal.Y, v.Normal.Z),
+                                        Vector2f(v.TextureCoordinate.X, v.TextureCoordinate.Y)});
+                }
+                face[j] = found.first->second;
             }
-            TriangleList.push_back(t);
+            indices.push_back(face);
         }
     }
 
     rst::rasterizer r(700, 700);
+    auto vert_id = r.load_vertices(vertices);
+    auto ind_id = r.load_indices(indices);
+    r.set_tile_rendering(true);
+    r.set_deferred_shading(true);
+    r.set_backface_culling(true);
 
     auto texture_path = "hmap.jpg";
     r.set_texture(Texture(obj_path + texture_path));
 
     std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = texture_fragment_shader;
+    std::string shader_name = "texture";
+    bool batched = false;
+
+    // Headless mode: Rasterizer --benchmark [frames] [output.json]
+    bool benchmark = argc >= 2 && std::string(argv[1]) == "--benchmark";
+    int frames = 100;
+    if (benchmark && argc >= 3 && !parse_frame_count(argv[2], frames))
+    {
+        std::cerr << "Invalid frame count " << argv[2] << "\n"
+                  << "Usage: Rasterizer --benchmark [frames] [output.json]\n";
+        return 1;
+    }
 
-    if (argc >= 2)
+    if (argc >= 2 && !benchmark)
     {
         command_line = true;
         filename = std::string(argv[1]);
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+        if (argc >= 3 && std::string(argv[2]) == "texture")
         {
+            shader_name = "texture";
             std::cout << "Rasterizing using the texture shader\n";
             active_shader = texture_fragment_shader;
             texture_path = "spot_texture.png";
             r.set_texture(Texture(obj_path + texture_path));
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        else if (argc >= 3 && std::string(argv[2]) == "normal")
         {
+            shader_name = "normal";
             std::cout << "Rasterizing using the normal shader\n";
             active_shader = normal_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+        else if (argc >= 3 && std::string(argv[2]) == "phong")
         {
+            shader_name = "phong";
             std::cout << "Rasterizing using the phong shader\n";
             active_shader = phong_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        else if (argc >= 3 && std::string(argv[2]) == "bump")
         {
+            shader_name = "bump";
             std::cout << "Rasterizing using the bump shader\n";
             active_shader = bump_fragment_shader;
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        else if (argc >= 3 && std::string(argv[2]) == "displacement")
         {
+            shader_name = "displacement";
             std::cout << "Rasterizing using the bump shader\n";
             active_shader = displacement_fragment_shader;
         }
+
+        // Render through the statically dispatched, batched shader path instead of std::function.
+        batched = argc >= 4 && std::string(argv[3]) == "batched";
     }
 
     Eigen::Vector3f eye_pos = {0,0,10};
@@ -400,9 +627,86 @@ int main(int argc, const char** argv)
     r.set_vertex_shader(vertex_shader);
     r.set_fragment_shader(active_shader);
 
+    auto draw_frame = [&]() {
+        if (!batched)
+        {
+            r.draw(vert_id, ind_id);
+        }
+        else if (shader_name == "normal")
+        {
+            r.draw(vert_id, ind_id, normal_batch_shader{});
+        }
+        else if (shader_name == "phong")
+        {
+            r.draw(vert_id, ind_id, phong_batch_shader{});
+        }
+        else if (shader_name == "bump")
+        {
+            r.draw(vert_id, ind_id, bump_batch_shader{});
+        }
+        else if (shader_name == "displacement")
+        {
+            r.draw(vert_id, ind_id, displacement_batch_shader{});
+        }
+        else
+        {
+            r.draw(vert_id, ind_id, texture_batch_shader{});
+        }
+    };
+
     int key = 0;
     int frame_count = 0;
 
+    if (benchmark)
+    {
+        Texture spot_texture(obj_path + "spot_texture.png");
+        Texture height_map(obj_path + "hmap.jpg");
+        std::vector<std::pair<std::string, std::function<Eigen::Vector3f(fragment_shader_payload)>>> shaders = {
+                {"normal", normal_fragment_shader},
+                {"phong", phong_fragment_shader},
+                {"texture", texture_fragment_shader},
+                {"bump", bump_fragment_shader},
+                {"displacement", displacement_fragment_shader}};
+
+        benchmark_report report("Assignment3");
+        for (const auto& shader : shaders)
+        {
+            for (bool batch : {false, true})
+            {
+                shader_name = shader.first;
+                batched = batch;
+                r.set_fragment_shader(shader.second);
+                r.set_texture(shader_name == "texture" ? spot_texture : height_map);
+                report.begin_run(shader_name + (batched ? "/batched" : ""));
+
+                // Every run sweeps one full turn of the model.
+                for (int frame = 0; frame < frames; ++frame)
+                {
+                    r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                    r.set_model(get_model_matrix(angle + 360.0f * frame / frames));
+                    r.set_view(get_view_matrix(eye_pos));
+                    r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+
+                    auto start = std::chrono::steady_clock::now();
+                    draw_frame();
+                    r.frame_buffer();
+                    report.add_frame(elapsed_ms(start), r.timings());
+                }
+            }
+        }
+
+        if (argc >= 4)
+        {
+            std::ofstream out(argv[3]);
+            report.write_json(out);
+        }
+        else
+        {
+            report.write_json(std::cout);
+        }
+        return 0;
+    }
+
     if (command_line)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -410,7 +714,17 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
+        auto start = std::chrono::steady_clock::now();
+        draw_frame();
+        r.frame_buffer();
+        auto stop = std::chrono::steady_clock::now();
+        std::cout << "Frame time: " << std::chrono::duration<double, std::milli>(stop - start).count()
+                  << " ms" << (batched ? " (batched)" : "") << '\n';
+        const auto& stats = r.stats();
+        std::cout << "Triangles: " << stats.submitted << " submitted, " << stats.rasterized << " rasterized, "
+                  << stats.frustum_culled << " outside the frustum, " << stats.backface_culled << " back-facing, "
+                  << stats.degenerate_culled << " degenerate, " << stats.clipped << " clipped\n";
+
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
         cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
@@ -429,7 +743,7 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
         //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
+        draw_frame();
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
         cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
@@ -3,9 +3,16 @@
 //
 
 #include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
@@ -42,6 +49,14 @@ rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>
     return {id};
 }
 
+rst::vert_buf_id rst::rasterizer::load_vertices(const std::vector<vertex>& vertices)
+{
+    auto id = get_next_id();
+    vert_buf.emplace(id, vertices);
+
+    return {id};
+}
+
 
 // Bresenham's line drawing algorithm
 void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
@@ -149,95 +164,558 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
+// Edge equation E(x, y) = a * x + b * y + c of one triangle edge, oriented so that
+// points inside the triangle give E > 0. E / area is the barycentric weight of the
+// vertex opposite to the edge.
+struct edge_equation
+{
+    float a, b, c;
+
+    float at(float x, float y) const { return a * x + b * y + c; }
+};
+
+struct triangle_edges
+{
+    edge_equation e[3];
+    float inv_area;
+};
+
+static constexpr int block_size = rst::rasterizer::block_size;
+
+// Coverage of one block_size x block_size pixel block (bit j * block_size + i is pixel
+// (bx + i, by + j)) together with the barycentric coordinates of every pixel in it.
+struct block_fragments
+{
+    uint64_t mask;
+    alignas(32) float alpha[block_size * block_size];
+    alignas(32) float beta[block_size * block_size];
+    alignas(32) float gamma[block_size * block_size];
+};
+
+static inline int lowest_bit(uint64_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctzll(mask);
+#endif
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+static bool setup_edges(const Vector4f* v, triangle_edges& edges)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vector4f& p = v[(i + 1) % 3];
+        const Vector4f& q = v[(i + 2) % 3];
+        edges.e[i] = {p.y() - q.y(), q.x() - p.x(), p.x() * q.y() - q.x() * p.y()};
+    }
+    float area = edges.e[0].at(v[0].x(), v[0].y());
+    if (area == 0 || !std::isfinite(area))
+    {
+        return false;
+    }
+    if (area < 0)
+    {
+        for (auto& e : edges.e)
+        {
+            e = {-e.a, -e.b, -e.c};
+        }
+        area = -area;
+    }
+    edges.inv_area = 1.0f / area;
+    return true;
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+// Evaluates the edge functions for one row of block_size pixels starting at (x, y), writes
+// the barycentric coordinates of the row and returns the row coverage bits.
+static unsigned rasterize_row(const triangle_edges& edges, float x, float y, float* alpha, float* beta, float* gamma)
+{
+    const edge_equation &e0 = edges.e[0], &e1 = edges.e[1], &e2 = edges.e[2];
+#if defined(__AVX__)
+    __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 inv_area = _mm256_set1_ps(edges.inv_area);
+    __m256 w0 = _mm256_add_ps(_mm256_set1_ps(e0.at(x, y)), _mm256_mul_ps(lane, _mm256_set1_ps(e0.a)));
+    __m256 w1 = _mm256_add_ps(_mm256_set1_ps(e1.at(x, y)), _mm256_mul_ps(lane, _mm256_set1_ps(e1.a)));
+    __m256 w2 = _mm256_add_ps(_mm256_set1_ps(e2.at(x, y)), _mm256_mul_ps(lane, _mm256_set1_ps(e2.a)));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_GT_OQ), _mm256_cmp_ps(w1, zero, _CMP_GT_OQ)),
+                                  _mm256_cmp_ps(w2, zero, _CMP_GT_OQ));
+    _mm256_store_ps(alpha, _mm256_mul_ps(w0, inv_area));
+    _mm256_store_ps(beta, _mm256_mul_ps(w1, inv_area));
+    _mm256_store_ps(gamma, _mm256_mul_ps(w2, inv_area));
+    return (unsigned) _mm256_movemask_ps(inside);
+#elif defined(__SSE2__)
+    unsigned bits = 0;
+    __m128 inv_area = _mm_set1_ps(edges.inv_area);
+    __m128 zero = _mm_setzero_ps();
+    for (int i = 0; i < block_size; i += 4)
+    {
+        __m128 lane = _mm_setr_ps((float) i, (float) i + 1, (float) i + 2, (float) i + 3);
+        __m128 w0 = _mm_add_ps(_mm_set1_ps(e0.at(x, y)), _mm_mul_ps(lane, _mm_set1_ps(e0.a)));
+        __m128 w1 = _mm_add_ps(_mm_set1_ps(e1.at(x, y)), _mm_mul_ps(lane, _mm_set1_ps(e1.a)));
+        __m128 w2 = _mm_add_ps(_mm_set1_ps(e2.at(x, y)), _mm_mul_ps(lane, _mm_set1_ps(e2.a)));
+        __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(w0, zero), _mm_cmpgt_ps(w1, zero)), _mm_cmpgt_ps(w2, zero));
+        _mm_store_ps(alpha + i, _mm_mul_ps(w0, inv_area));
+        _mm_store_ps(beta + i, _mm_mul_ps(w1, inv_area));
+        _mm_store_ps(gamma + i, _mm_mul_ps(w2, inv_area));
+        bits |= (unsigned) _mm_movemask_ps(inside) << i;
+    }
+    return bits;
+#else
+    unsigned bits = 0;
+    float w0 = e0.at(x, y), w1 = e1.at(x, y), w2 = e2.at(x, y);
+    for (int i = 0; i < block_size; ++i)
+    {
+        float l0 = w0 + i * e0.a, l1 = w1 + i * e1.a, l2 = w2 + i * e2.a;
+        alpha[i] = l0 * edges.inv_area;
+        beta[i] = l1 * edges.inv_area;
+        gamma[i] = l2 * edges.inv_area;
+        bits |= (unsigned) (l0 > 0 && l1 > 0 && l2 > 0) << i;
+    }
+    return bits;
+#endif
+}
+
+// Rasterizes the pixels [x0, x1) x [y0, y1) of the block whose lower left corner is (bx, by).
+// Blocks outside any edge are rejected from their corners without touching pixels, and
+// blocks inside all edges skip the per-pixel tests.
+static bool rasterize_block(const triangle_edges& edges, int bx, int by, int x0, int y0, int x1, int y1,
+                            block_fragments& block)
+{
+    bool covered = true;
+    for (const auto& e : edges.e)
+    {
+        float w00 = e.at(x0, y0), w10 = e.at(x1 - 1, y0);
+        float w01 = e.at(x0, y1 - 1), w11 = e.at(x1 - 1, y1 - 1);
+        if (std::max({w00, w10, w01, w11}) <= 0)
+        {
+            return false;
+        }
+        covered &= std::min({w00, w10, w01, w11}) > 0;
+    }
 
+    unsigned row_mask = ((1u << (x1 - bx)) - 1) & ~((1u << (x0 - bx)) - 1);
+    block.mask = 0;
+    for (int y = y0; y < y1; ++y)
+    {
+        int offset = (y - by) * block_size;
+        unsigned bits = rasterize_row(edges, bx, y, block.alpha + offset, block.beta + offset, block.gamma + offset);
+        bits = covered ? row_mask : bits & row_mask;
+        block.mask |= (uint64_t) bits << offset;
+    }
+    return block.mask != 0;
+}
+
+void rst::rasterizer::process_vertices(const std::vector<vertex>& vertices)
+{
+    // Transforms shared by every vertex of the draw.
+    Eigen::Matrix4f mv = view * model;
+    Eigen::Matrix4f mvp = projection * mv;
+    Eigen::Matrix4f inv_trans = mv.inverse().transpose();
+
+    // Sign of w for a point in front of the eye (view space z = -1). Clip positions are kept
+    // with w > 0 in front so that clipping does not depend on the projection's convention.
+    clip_w_sign = projection(3, 3) - projection(3, 2) < 0 ? -1.0f : 1.0f;
+
+    constexpr int chunk_size = 1024;
+    post_transform.resize(vertices.size());
+    int chunks = ((int) vertices.size() + chunk_size - 1) / chunk_size;
+    parallel_for(chunks, [&](int chunk) {
+        int end = std::min((chunk + 1) * chunk_size, (int) vertices.size());
+        for (int i = chunk * chunk_size; i < end; ++i)
+        {
+            const vertex& in = vertices[i];
+            Eigen::Vector4f position = to_vec4(in.position, 1.0f);
+            if (vertex_shader)
+            {
+                position = to_vec4(vertex_shader({in.position, in.normal, in.tex_coords}), 1.0f);
+            }
+
+            transformed_vertex& out = post_transform[i];
+            out.view_pos = (mv * position).head<3>();
+            out.normal = (inv_trans * to_vec4(in.normal, 0.0f)).head<3>();
+            out.tex_coords = in.tex_coords;
+            out.clip_pos = clip_w_sign * (mvp * position);
+            out.screen_pos = viewport_transform(out.clip_pos);
+        }
+    });
+}
+
+Eigen::Vector4f rst::rasterizer::viewport_transform(const Eigen::Vector4f& clip_pos) const
+{
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
-    {
-        Triangle newtri = *t;
-
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
-
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
-
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
-
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
-        }
+    //Homogeneous division
+    Eigen::Vector4f v = clip_w_sign * clip_pos;
+    v.x() /= v.w();
+    v.y() /= v.w();
+    v.z() /= v.w();
+
+    //Viewport transformation
+    v.x() = 0.5 * width * (v.x() + 1.0);
+    v.y() = 0.5 * height * (v.y() + 1.0);
+    v.z() = v.z() * f1 + f2;
+    return v;
+}
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+// Clip planes as signed distances that are >= 0 on the inside. Planes 0-3 are the sides of the
+// view frustum and are only used for rejection; 4 is w-near and 5-8 the guard band, which
+// triangles are clipped against.
+static constexpr int frustum_planes = 4;
+static constexpr int clip_planes = 9;
 
-        //Viewport transformation
-        for (auto & vert : v)
+static float clip_distance(const Eigen::Vector4f& p, int plane)
+{
+    constexpr float g = rst::rasterizer::guard_band;
+    switch (plane)
+    {
+        case 0: return p.w() + p.x();
+        case 1: return p.w() - p.x();
+        case 2: return p.w() + p.y();
+        case 3: return p.w() - p.y();
+        case 4: return p.w() - rst::rasterizer::near_w;
+        case 5: return g * p.w() + p.x();
+        case 6: return g * p.w() - p.x();
+        case 7: return g * p.w() + p.y();
+        default: return g * p.w() - p.y();
+    }
+}
+
+static unsigned clip_outcode(const Eigen::Vector4f& p)
+{
+    unsigned code = 0;
+    for (int plane = 0; plane < clip_planes; ++plane)
+    {
+        code |= (clip_distance(p, plane) < 0 ? 1u : 0u) << plane;
+    }
+    return code;
+}
+
+void rst::rasterizer::assemble_triangles(const std::vector<Eigen::Vector3i>& indices)
+{
+    constexpr unsigned clip_mask = ((1u << clip_planes) - 1) & ~((1u << frustum_planes) - 1);
+    // Every plane adds at most one vertex to the polygon.
+    constexpr int max_vertices = 3 + clip_planes - frustum_planes;
+
+    assembled.clear();
+    assembled_view_pos.clear();
+    for (const auto& face : indices)
+    {
+        ++primitive_counts.submitted;
+        const transformed_vertex* v[3] = {&post_transform[face[0]], &post_transform[face[1]], &post_transform[face[2]]};
+
+        // A triangle with all vertices outside the same plane is outside the frustum.
+        unsigned outside_all = ~0u, outside_any = 0;
+        for (const auto* p : v)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            unsigned code = clip_outcode(p->clip_pos);
+            outside_all &= code;
+            outside_any |= code;
+        }
+        if (outside_all)
+        {
+            ++primitive_counts.frustum_culled;
+            continue;
+        }
+        if (!(outside_any & clip_mask))
+        {
+            emit_triangle(*v[0], *v[1], *v[2]);
+            continue;
         }
 
+        // Sutherland-Hodgman against w-near and the guard band. Attributes are linear in clip
+        // space, so new vertices interpolate all of them with the same weight.
+        ++primitive_counts.clipped;
+        transformed_vertex polygon[2][max_vertices];
+        int count = 3;
         for (int i = 0; i < 3; ++i)
         {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
+            polygon[0][i] = *v[i];
+        }
+        int current = 0;
+        for (int plane = frustum_planes; plane < clip_planes && count > 0; ++plane)
+        {
+            if (!(outside_any & (1u << plane)))
+            {
+                continue;
+            }
+            const transformed_vertex* in = polygon[current];
+            transformed_vertex* out = polygon[current ^ 1];
+            int out_count = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                const transformed_vertex& p = in[i];
+                const transformed_vertex& q = in[(i + 1) % count];
+                float dp = clip_distance(p.clip_pos, plane), dq = clip_distance(q.clip_pos, plane);
+                if (dp >= 0)
+                {
+                    out[out_count++] = p;
+                }
+                if ((dp >= 0) != (dq >= 0))
+                {
+                    float t = dp / (dp - dq);
+                    transformed_vertex& r = out[out_count++];
+                    r.clip_pos = p.clip_pos + t * (q.clip_pos - p.clip_pos);
+                    r.view_pos = p.view_pos + t * (q.view_pos - p.view_pos);
+                    r.normal = p.normal + t * (q.normal - p.normal);
+                    r.tex_coords = p.tex_coords + t * (q.tex_coords - p.tex_coords);
+                }
+            }
+            count = out_count;
+            current ^= 1;
         }
 
-        for (int i = 0; i < 3; ++i)
+        transformed_vertex* clipped = polygon[current];
+        for (int i = 0; i < count; ++i)
+        {
+            clipped[i].screen_pos = viewport_transform(clipped[i].clip_pos);
+        }
+        for (int i = 1; i + 1 < count; ++i)
+        {
+            emit_triangle(clipped[0], clipped[i], clipped[i + 1]);
+        }
+    }
+}
+
+void rst::rasterizer::emit_triangle(const transformed_vertex& v0, const transformed_vertex& v1, const transformed_vertex& v2)
+{
+    const Eigen::Vector4f &a = v0.screen_pos, &b = v1.screen_pos, &c = v2.screen_pos;
+    float area = (b.x() - a.x()) * (c.y() - a.y()) - (c.x() - a.x()) * (b.y() - a.y());
+    if (area == 0 || !std::isfinite(area))
+    {
+        ++primitive_counts.degenerate_culled;
+        return;
+    }
+    // Counter clockwise triangles face the viewer. The viewport keeps y up while x is
+    // mirrored by the projection, so they arrive here with negative area.
+    if (backface_culling && area > 0)
+    {
+        ++primitive_counts.backface_culled;
+        return;
+    }
+    // Pixels are sampled at integer coordinates; a bounding box without one covers nothing.
+    if (std::ceil(std::min({a.x(), b.x(), c.x()})) > std::floor(std::max({a.x(), b.x(), c.x()})) ||
+        std::ceil(std::min({a.y(), b.y(), c.y()})) > std::floor(std::max({a.y(), b.y(), c.y()})))
+    {
+        ++primitive_counts.degenerate_culled;
+        return;
+    }
+
+    ++primitive_counts.rasterized;
+    assembled.emplace_back();
+    Triangle& newtri = assembled.back();
+    const transformed_vertex* v[3] = {&v0, &v1, &v2};
+    std::array<Eigen::Vector3f, 3> view_pos;
+    for (int j = 0; j < 3; ++j)
+    {
+        //screen space coordinates
+        newtri.setVertex(j, v[j]->screen_pos);
+        //view space normal
+        newtri.setNormal(j, v[j]->normal);
+        newtri.setTexCoord(j, v[j]->tex_coords);
+        view_pos[j] = v[j]->view_pos;
+    }
+    assembled_view_pos.push_back(view_pos);
+
+    newtri.setColor(0, 148,121.0,92.0);
+    newtri.setColor(1, 148,121.0,92.0);
+    newtri.setColor(2, 148,121.0,92.0);
+}
+
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+
+    rasterize_triangles(TriangleList, deferred_shading);
+    resolve_pending |= deferred_shading;
+}
+
+void rst::rasterizer::draw(vert_buf_id vert_buffer, ind_buf_id ind_buffer)
+{
+    rasterize_indexed(vert_buf[vert_buffer.vert_id], ind_buf[ind_buffer.ind_id], deferred_shading);
+    resolve_pending |= deferred_shading;
+}
+
+void rst::rasterizer::rasterize_triangles(std::vector<Triangle *> &TriangleList, bool to_gbuffer)
+{
+    // A triangle list is an indexed draw without shared vertices.
+    std::vector<vertex> vertices;
+    std::vector<Eigen::Vector3i> indices;
+    vertices.reserve(TriangleList.size() * 3);
+    indices.reserve(TriangleList.size());
+    for (const auto& t : TriangleList)
+    {
+        int first = (int) vertices.size();
+        for (int j = 0; j < 3; ++j)
+        {
+            vertices.push_back({t->v[j].head<3>(), t->normal[j], t->tex_coords[j]});
+        }
+        indices.emplace_back(first, first + 1, first + 2);
+    }
+    rasterize_indexed(vertices, indices, to_gbuffer);
+}
+
+void rst::rasterizer::rasterize_indexed(const std::vector<vertex>& vertices, const std::vector<Eigen::Vector3i>& indices,
+                                        bool to_gbuffer)
+{
+    auto start = std::chrono::steady_clock::now();
+    process_vertices(vertices);
+    frame_timings.vertex += elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    assemble_triangles(indices);
+    frame_timings.setup += elapsed_ms(start);
+    frame_timings.triangles += (long long) indices.size();
+
+    start = std::chrono::steady_clock::now();
+    if (to_gbuffer && gbuffer.size() != frame_buf.size())
+    {
+        gbuffer.assign(frame_buf.size(), gbuffer_texel());
+    }
+    render_target screen = screen_target(to_gbuffer);
+
+    long long fragments = 0;
+    if (!tile_rendering)
+    {
+        for (size_t i = 0; i < assembled.size(); ++i)
         {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            // Also pass view space vertice position
+            fragments += rasterize_triangle(assembled[i], assembled_view_pos[i], screen);
         }
+    }
+    else
+    {
+        fragments = draw_tiled(assembled, assembled_view_pos, screen);
+    }
+    frame_timings.raster += elapsed_ms(start);
+    frame_timings.fragments += fragments;
+}
+
+long long rst::rasterizer::draw_tiled(const std::vector<Triangle>& triangles,
+                                      const std::vector<std::array<Eigen::Vector3f, 3>>& view_pos,
+                                      const render_target& screen)
+{
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+
+    // Binning: every tile keeps the triangles overlapping it in submission order,
+    // so per-pixel depth test order (and therefore the output) matches the serial path.
+    std::vector<std::vector<int>> bins(tiles_x * tiles_y);
+    for (int i = 0; i < (int) triangles.size(); ++i)
+    {
+        const Triangle& t = triangles[i];
+        int xmin = (int) std::floor(std::min({t.v[0].x(), t.v[1].x(), t.v[2].x()}));
+        int xmax = (int) std::ceil(std::max({t.v[0].x(), t.v[1].x(), t.v[2].x()}));
+        int ymin = (int) std::floor(std::min({t.v[0].y(), t.v[1].y(), t.v[2].y()}));
+        int ymax = (int) std::ceil(std::max({t.v[0].y(), t.v[1].y(), t.v[2].y()}));
+        xmin = std::max(xmin, 0);
+        ymin = std::max(ymin, 0);
+        xmax = std::min(xmax, width);
+        ymax = std::min(ymax, height);
+        if (xmin >= xmax || ymin >= ymax)
+        {
+            continue;
+        }
+        for (int ty = ymin / tile_size; ty <= (ymax - 1) / tile_size; ++ty)
+        {
+            for (int tx = xmin / tile_size; tx <= (xmax - 1) / tile_size; ++tx)
+            {
+                bins[ty * tiles_x + tx].push_back(i);
+            }
+        }
+    }
+
+    std::atomic<int> next_tile(0);
+    std::atomic<long long> fragments(0);
+    auto tile_task = [&]() {
+        long long tile_fragments = 0;
+        std::vector<Eigen::Vector3f> tile_color(tile_size * tile_size);
+        std::vector<float> tile_depth(tile_size * tile_size);
+        std::vector<float> tile_hiz((tile_size / block_size) * (tile_size / block_size));
+        std::vector<gbuffer_texel> tile_gbuffer(screen.gbuffer ? tile_size * tile_size : 0);
+        for (int tile = next_tile++; tile < tiles_x * tiles_y; tile = next_tile++)
+        {
+            const auto& bin = bins[tile];
+            if (bin.empty())
+            {
+                continue;
+            }
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
+            render_target target;
+            target.x0 = (tile % tiles_x) * tile_size;
+            target.y0 = (tile / tiles_x) * tile_size;
+            target.x1 = std::min(target.x0 + tile_size, width);
+            target.y1 = std::min(target.y0 + tile_size, height);
+            target.color = tile_color.data();
+            target.depth = tile_depth.data();
+            target.origin = -(target.y0 * tile_size + target.x0);
+            target.pitch = tile_size;
+            target.hiz = tile_hiz.data();
+            target.hiz_pitch = tile_size / block_size;
+            target.hiz_origin = -((target.y0 / block_size) * target.hiz_pitch + target.x0 / block_size);
+            target.gbuffer = screen.gbuffer ? tile_gbuffer.data() : nullptr;
+
+            for (int y = target.y0; y < target.y1; ++y)
+            {
+                for (int x = target.x0; x < target.x1; ++x)
+                {
+                    target.color[target.index(x, y)] = screen.color[screen.index(x, y)];
+                    target.depth[target.index(x, y)] = screen.depth[screen.index(x, y)];
+                    if (target.gbuffer)
+                    {
+                        target.gbuffer[target.index(x, y)] = screen.gbuffer[screen.index(x, y)];
+                    }
+                }
+            }
+            for (int y = target.y0; y < target.y1; y += block_size)
+            {
+                for (int x = target.x0; x < target.x1; x += block_size)
+                {
+                    target.hiz[target.hiz_index(x, y)] = screen.hiz[screen.hiz_index(x, y)];
+                }
+            }
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+            for (int i : bin)
+            {
+                tile_fragments += rasterize_triangle(triangles[i], view_pos[i], target);
+            }
+
+            for (int y = target.y0; y < target.y1; ++y)
+            {
+                for (int x = target.x0; x < target.x1; ++x)
+                {
+                    screen.color[screen.index(x, y)] = target.color[target.index(x, y)];
+                    screen.depth[screen.index(x, y)] = target.depth[target.index(x, y)];
+                    if (target.gbuffer)
+                    {
+                        screen.gbuffer[screen.index(x, y)] = target.gbuffer[target.index(x, y)];
+                    }
+                }
+            }
+            for (int y = target.y0; y < target.y1; y += block_size)
+            {
+                for (int x = target.x0; x < target.x1; x += block_size)
+                {
+                    screen.hiz[screen.hiz_index(x, y)] = target.hiz[target.hiz_index(x, y)];
+                }
+            }
+        }
+        fragments += tile_fragments;
+    };
+
+    int threads = worker_count(tiles_x * tiles_y);
+    std::vector<std::future<void>> futures;
+    for (int i = 1; i < threads; ++i)
+    {
+        futures.emplace_back(std::async(std::launch::async, tile_task));
     }
+    tile_task();
+    for (auto& future : futures)
+    {
+        future.get();
+    }
+    return fragments;
 }
 
 static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
@@ -257,7 +735,8 @@ static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const E
 }
 
 //Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
+int rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos,
+                                         const render_target& target)
 {
     // TODO: From your HW3, get the triangle rasterization code.
     // TODO: Inside your rasterization loop:
@@ -280,49 +759,194 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eig
     // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
     // Use: auto pixel_color = fragment_shader(payload);
 
-    // Find out the bounding box of current triangle.
-    // iterate through the pixel and find if the current pixel is inside the triangle
+    // Find out the bounding box of current triangle, then walk it in block_size x block_size
+    // blocks using the triangle's edge equations to find the covered pixels.
     const Vector4f &a= t.a(), &b = t.b(), &c = t.c();
     float xmin = std::floor(std::min({a.x(), b.x(), c.x()}));
     float xmax = std::ceil(std::max({a.x(), b.x(), c.x()}));
     float ymin = std::floor(std::min({a.y(), b.y(), c.y()}));
     float ymax = std::ceil(std::max({a.y(), b.y(), c.y()}));
-    for (int x = (int) xmin; x < (int) xmax; ++x)
+    int x_begin = std::max((int) xmin, target.x0), x_end = std::min((int) xmax, target.x1);
+    int y_begin = std::max((int) ymin, target.y0), y_end = std::min((int) ymax, target.y1);
+    if (x_begin >= x_end || y_begin >= y_end)
     {
-        for (int y = (int) ymin; y < (int) ymax; ++y)
+        return 0;
+    }
+
+    // Screen z of every fragment is a convex combination of the vertex z values, so no
+    // fragment is nearer than the nearest vertex. Blocks (and whole triangles) whose stored
+    // maximum depth is not farther than that cannot pass a single depth test.
+    float z_near = std::min({-a.z(), -b.z(), -c.z()});
+    int bx_begin = x_begin - x_begin % block_size, by_begin = y_begin - y_begin % block_size;
+    bool visible = false;
+    for (int by = by_begin; by < y_end && !visible; by += block_size)
+    {
+        for (int bx = bx_begin; bx < x_end && !visible; bx += block_size)
         {
-            if (!insideTriangle(x, y, t.v))
+            visible = z_near < target.hiz[target.hiz_index(bx, by)];
+        }
+    }
+    if (!visible)
+    {
+        return 0;
+    }
+
+    triangle_edges edges;
+    if (!setup_edges(t.v, edges))
+    {
+        return 0;
+    }
+
+    // Attributes are interpolated linearly in screen space, so their derivatives are constant
+    // over the triangle: d(alpha)/dx = e0.a / area and so on.
+    Vector2f tex_dx = (edges.e[0].a * t.tex_coords[0] + edges.e[1].a * t.tex_coords[1] + edges.e[2].a * t.tex_coords[2]) * edges.inv_area;
+    Vector2f tex_dy = (edges.e[0].b * t.tex_coords[0] + edges.e[1].b * t.tex_coords[1] + edges.e[2].b * t.tex_coords[2]) * edges.inv_area;
+
+    int fragments = 0;
+    block_fragments block;
+    for (int by = by_begin; by < y_end; by += block_size)
+    {
+        for (int bx = bx_begin; bx < x_end; bx += block_size)
+        {
+            float& block_depth = target.hiz[target.hiz_index(bx, by)];
+            if (z_near >= block_depth)
             {
                 continue;
             }
 
-            // If so, use the following code to get the interpolated z value.
-            auto [alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-            float w_reciprocal = 1.0 / (alpha / a.w() + beta / b.w() + gamma / c.w());
-            float z_interpolated = alpha * a.z() / a.w() + beta * b.z() / b.w() + gamma * c.z() / c.w();
-            z_interpolated *= w_reciprocal;
+            int x0 = std::max(bx, x_begin), x1 = std::min(bx + block_size, x_end);
+            int y0 = std::max(by, y_begin), y1 = std::min(by + block_size, y_end);
+            if (!rasterize_block(edges, bx, by, x0, y0, x1, y1, block))
+            {
+                continue;
+            }
 
-            // set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
-            unsigned index = get_index(x, y);
-            if (-z_interpolated >= depth_buf[index])
+            bool depth_written = false;
+            for (uint64_t mask = block.mask; mask; mask &= mask - 1)
+            {
+                int i = lowest_bit(mask);
+                int x = bx + i % block_size, y = by + i / block_size;
+                float alpha = block.alpha[i], beta = block.beta[i], gamma = block.gamma[i];
+
+                float w_reciprocal = 1.0 / (alpha / a.w() + beta / b.w() + gamma / c.w());
+                float z_interpolated = alpha * a.z() / a.w() + beta * b.z() / b.w() + gamma * c.z() / c.w();
+                z_interpolated *= w_reciprocal;
+
+                // set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
+                int index = target.index(x, y);
+                if (-z_interpolated >= target.depth[index])
+                {
+                    continue;
+                }
+                target.depth[index] = -z_interpolated;
+                depth_written = true;
+                ++fragments;
+
+                const auto& color = t.color;
+                Vector3f interpolated_color = interpolate(alpha, beta, gamma, color[0], color[1], color[2], 1.0f);
+                const auto& normal = t.normal;
+                Vector3f interpolated_normal = interpolate(alpha, beta, gamma, normal[0], normal[1], normal[2], 1.0f);
+                interpolated_normal = interpolated_normal.normalized();
+                Vector2f interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1.0f);
+                Vector3f interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1.0f);
+                if (target.gbuffer)
+                {
+                    target.gbuffer[index] = {interpolated_shadingcoords, interpolated_color, interpolated_normal.normalized(),
+                                             interpolated_texcoords, tex_dx, tex_dy, true};
+                    continue;
+                }
+                fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
+                payload.view_pos = interpolated_shadingcoords;
+                payload.tex_dx = tex_dx;
+                payload.tex_dy = tex_dy;
+                auto pixel_color = fragment_shader(payload);
+                target.color[index] = pixel_color;
+            }
+
+            if (depth_written)
+            {
+                block_depth = block_max_depth(target, bx, by);
+            }
+        }
+    }
+    return fragments;
+}
+
+void rst::rasterizer::set_deferred_shading(bool enable)
+{
+    resolve();
+    deferred_shading = enable;
+}
+
+void rst::rasterizer::resolve()
+{
+    if (!resolve_pending)
+    {
+        return;
+    }
+    resolve_pending = false;
+
+    auto start = std::chrono::steady_clock::now();
+    Texture* tex = texture ? &*texture : nullptr;
+    for_each_row([&](int row) {
+        for (int index = row * width; index < (row + 1) * width; ++index)
+        {
+            gbuffer_texel& texel = gbuffer[index];
+            if (!texel.covered)
             {
                 continue;
             }
-            depth_buf[index] = -z_interpolated;
-
-            const auto& color = t.color;
-            Vector3f interpolated_color = interpolate(alpha, beta, gamma, color[0], color[1], color[2], 1.0f);
-            const auto& normal = t.normal;
-            Vector3f interpolated_normal = interpolate(alpha, beta, gamma, normal[0], normal[1], normal[2], 1.0f);
-            interpolated_normal = interpolated_normal.normalized();
-            Vector2f interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1.0f);
-            Vector3f interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1.0f);
-            fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-            payload.view_pos = interpolated_shadingcoords;
-            auto pixel_color = fragment_shader(payload);
-            set_pixel({x, y}, pixel_color);
+            fragment_shader_payload payload(texel.color, texel.normal, texel.tex_coords, tex);
+            payload.view_pos = texel.view_pos;
+            payload.tex_dx = texel.tex_dx;
+            payload.tex_dy = texel.tex_dy;
+            frame_buf[index] = fragment_shader(payload);
+            texel.covered = false;
+        }
+    });
+    frame_timings.shade += elapsed_ms(start);
+}
+
+void rst::rasterizer::parallel_for(int jobs, const std::function<void(int)>& job_task)
+{
+    std::atomic<int> next_job(0);
+    auto task = [&]() {
+        for (int job = next_job++; job < jobs; job = next_job++)
+        {
+            job_task(job);
+        }
+    };
+
+    int threads = worker_count(jobs);
+    std::vector<std::future<void>> futures;
+    for (int i = 1; i < threads; ++i)
+    {
+        futures.emplace_back(std::async(std::launch::async, task));
+    }
+    task();
+    for (auto& future : futures)
+    {
+        future.get();
+    }
+}
+
+int rst::rasterizer::worker_count(int jobs) const
+{
+    int threads = num_threads > 0 ? num_threads : static_cast<int>(std::thread::hardware_concurrency());
+    return std::max(1, std::min(threads, jobs));
+}
+
+float rst::rasterizer::block_max_depth(const render_target& target, int bx, int by)
+{
+    float depth = -std::numeric_limits<float>::infinity();
+    for (int y = by; y < std::min(by + block_size, target.y1); ++y)
+    {
+        for (int x = bx; x < std::min(bx + block_size, target.x1); ++x)
+        {
+            depth = std::max(depth, target.depth[target.index(x, y)]);
         }
     }
+    return depth;
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -345,10 +969,15 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(gbuffer.begin(), gbuffer.end(), gbuffer_texel());
+        resolve_pending = false;
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        std::fill(hiz_buf.begin(), hiz_buf.end(), std::numeric_limits<float>::infinity());
+        primitive_counts = primitive_stats();
+        frame_timings = stage_timings();
     }
 }
 
@@ -356,19 +985,27 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
     depth_buf.resize(w * h);
+    hiz_buf.resize(((w + block_size - 1) / block_size) * ((h + block_size - 1) / block_size));
 
     texture = std::nullopt;
 }
 
 int rst::rasterizer::get_index(int x, int y)
 {
-    return (height-y)*width + x;
+    return (height-1-y)*width + x;
+}
+
+rst::rasterizer::render_target rst::rasterizer::screen_target(bool to_gbuffer)
+{
+    return {0, 0, width, height, frame_buf.data(), depth_buf.data(), (height-1)*width, -width,
+            hiz_buf.data(), 0, (width + block_size - 1) / block_size,
+            to_gbuffer ? gbuffer.data() : nullptr};
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
+    int ind = (height-1-point.y())*width + point.x();
     frame_buf[ind] = color;
 }
 
@@ -7,6 +7,10 @@
 #include <eigen3/Eigen/Eigen>
 #include <optional>
 #include <algorithm>
+#include <array>
+#include <functional>
+#include <vector>
+#include "benchmark.hpp"
 #include "global.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
@@ -57,6 +61,19 @@ namespace rst
         int col_id = 0;
     };
 
+    struct vert_buf_id
+    {
+        int vert_id = 0;
+    };
+
+    // One entry of an indexed vertex buffer, in object space.
+    struct vertex
+    {
+        Eigen::Vector3f position;
+        Eigen::Vector3f normal;
+        Eigen::Vector2f tex_coords;
+    };
+
     class rasterizer
     {
     public:
@@ -65,6 +82,7 @@ namespace rst
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
         col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        vert_buf_id load_vertices(const std::vector<vertex>& vertices);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
@@ -77,17 +95,134 @@ namespace rst
 
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
+        // Sort-middle mode: triangles are binned into tile_size x tile_size screen tiles and
+        // the tiles are rasterized and shaded by worker threads. Output matches the serial path.
+        void set_tile_rendering(bool enable) { tile_rendering = enable; }
+        void set_num_threads(int n) { num_threads = n; }
+
+        // Deferred mode: draw() only fills a G-buffer with the attributes of the nearest fragment,
+        // and resolve() runs the fragment shader once per covered pixel. The texture and shader
+        // bound at resolve time are used. frame_buffer() resolves pending pixels on access.
+        void set_deferred_shading(bool enable);
+        void resolve();
+
+        // Primitive assembly culls triangles outside the view frustum, back faces (when enabled)
+        // and triangles that cover no pixel sample, and clips triangles that cross the w-near
+        // plane or leave the guard band. The counters accumulate until the depth buffer is cleared.
+        struct primitive_stats
+        {
+            int submitted = 0;
+            int frustum_culled = 0;
+            int backface_culled = 0;
+            int degenerate_culled = 0;
+            int clipped = 0;
+            int rasterized = 0;
+        };
+
+        void set_backface_culling(bool enable) { backface_culling = enable; }
+        const primitive_stats& stats() const { return primitive_counts; }
+        const stage_timings& timings() const { return frame_timings; }
+
+        // Clip space w below which vertices count as behind the eye, and the extent of the
+        // guard band in NDC units. Triangles inside the guard band are not clipped at the
+        // screen edges; the rasterizer's bounding box clamp handles them.
+        static constexpr float near_w = 1e-5f;
+        static constexpr float guard_band = 4.0f;
+
+        static constexpr int tile_size = 32;
+        // Edge of the pixel blocks the rasterizer walks; also the Hi-Z granularity.
+        static constexpr int block_size = 8;
+        static_assert(tile_size % block_size == 0, "tiles must consist of whole blocks");
+
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
         void draw(std::vector<Triangle *> &TriangleList);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Indexed draw: the vertex stage (vertex shader, transforms and viewport) runs once per
+        // vertex of the buffer, in parallel, and triangles are assembled from the results.
+        void draw(vert_buf_id vert_buffer, ind_buf_id ind_buffer);
+
+        // Statically dispatched path: the triangles go through the G-buffer and Shader is then
+        // invoked on fragment_batch::size covered pixels at a time, so it can be inlined and
+        // vectorized across pixels. Shader must provide void operator()(fragment_batch&) const.
+        template <typename Shader>
+        void draw(std::vector<Triangle *> &TriangleList, const Shader& shader);
+        template <typename Shader>
+        void draw(vert_buf_id vert_buffer, ind_buf_id ind_buffer, const Shader& shader);
+
+        std::vector<Eigen::Vector3f>& frame_buffer() { resolve(); return frame_buf; }
 
     private:
+        struct gbuffer_texel
+        {
+            Eigen::Vector3f view_pos;
+            Eigen::Vector3f color;
+            Eigen::Vector3f normal;
+            Eigen::Vector2f tex_coords;
+            Eigen::Vector2f tex_dx, tex_dy;
+            bool covered = false;
+        };
+
+        // A window of pixels [x0, x1) x [y0, y1) backed by color/depth storage,
+        // either the whole frame buffer or a tile-local copy of one tile.
+        // hiz holds the maximum depth of every block_size x block_size block.
+        struct render_target
+        {
+            int x0, y0, x1, y1;
+            Eigen::Vector3f* color;
+            float* depth;
+            int origin, pitch;
+            float* hiz;
+            int hiz_origin, hiz_pitch;
+            gbuffer_texel* gbuffer;
+
+            int index(int x, int y) const { return origin + y * pitch + x; }
+            int hiz_index(int x, int y) const { return hiz_origin + (y / block_size) * hiz_pitch + x / block_size; }
+        };
+
+        // Output of the vertex stage for one vertex.
+        struct transformed_vertex
+        {
+            // Clip space position, negated if needed so that w > 0 in front of the eye.
+            Eigen::Vector4f clip_pos;
+            Eigen::Vector4f screen_pos;
+            Eigen::Vector3f view_pos;
+            Eigen::Vector3f normal;
+            Eigen::Vector2f tex_coords;
+        };
+
+        static float block_max_depth(const render_target& target, int bx, int by);
+
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        void process_vertices(const std::vector<vertex>& vertices);
+        void assemble_triangles(const std::vector<Eigen::Vector3i>& indices);
+        void emit_triangle(const transformed_vertex& v0, const transformed_vertex& v1, const transformed_vertex& v2);
+        Eigen::Vector4f viewport_transform(const Eigen::Vector4f& clip_pos) const;
+
+        // Returns the number of fragments that passed the depth test.
+        int rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos,
+                                const render_target& target);
+
+        void rasterize_triangles(std::vector<Triangle *> &TriangleList, bool to_gbuffer);
+        void rasterize_indexed(const std::vector<vertex>& vertices, const std::vector<Eigen::Vector3i>& indices,
+                               bool to_gbuffer);
+
+        long long draw_tiled(const std::vector<Triangle>& triangles,
+                        const std::vector<std::array<Eigen::Vector3f, 3>>& view_pos,
+                             const render_target& screen);
+
+        template <typename Shader>
+        void shade_gbuffer(const Shader& shader);
+        template <typename Shader>
+        void shade_batch(const Shader& shader, fragment_batch& batch, const int* pixels, int count);
+
+        render_target screen_target(bool to_gbuffer);
+
+        int worker_count(int jobs) const;
+        void parallel_for(int jobs, const std::function<void(int)>& job_task);
+        void for_each_row(const std::function<void(int)>& row_task) { parallel_for(height, row_task); }
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -102,6 +237,13 @@ namespace rst
         std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
         std::map<int, std::vector<Eigen::Vector3f>> col_buf;
         std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        std::map<int, std::vector<vertex>> vert_buf;
+
+        // Post-transform cache of the vertex buffer being drawn, indexed like it, and the
+        // triangles assembled from it. Kept between draws to reuse the allocations.
+        std::vector<transformed_vertex> post_transform;
+        std::vector<Triangle> assembled;
+        std::vector<std::array<Eigen::Vector3f, 3>> assembled_view_pos;
 
         std::optional<Texture> texture;
 
@@ -110,11 +252,113 @@ namespace rst
 
         std::vector<Eigen::Vector3f> frame_buf;
         std::vector<float> depth_buf;
+        std::vector<float> hiz_buf;
+        std::vector<gbuffer_texel> gbuffer;
         int get_index(int x, int y);
 
         int width, height;
 
+        bool backface_culling = false;
+        float clip_w_sign = 1.0f;
+        primitive_stats primitive_counts;
+        stage_timings frame_timings;
+
+        bool tile_rendering = false;
+        int num_threads = 0;
+        bool deferred_shading = false;
+        bool resolve_pending = false;
+
         int next_id = 0;
         int get_next_id() { return next_id++; }
     };
+
+    template <typename Shader>
+    void rasterizer::draw(std::vector<Triangle *> &TriangleList, const Shader& shader)
+    {
+        resolve();
+        rasterize_triangles(TriangleList, true);
+        shade_gbuffer(shader);
+    }
+
+    template <typename Shader>
+    void rasterizer::draw(vert_buf_id vert_buffer, ind_buf_id ind_buffer, const Shader& shader)
+    {
+        resolve();
+        rasterize_indexed(vert_buf[vert_buffer.vert_id], ind_buf[ind_buffer.ind_id], true);
+        shade_gbuffer(shader);
+    }
+
+    template <typename Shader>
+    void rasterizer::shade_gbuffer(const Shader& shader)
+    {
+        auto start = std::chrono::steady_clock::now();
+        Texture* tex = texture ? &*texture : nullptr;
+        for_each_row([&](int row) {
+            fragment_batch batch;
+            batch.texture = tex;
+            int pixels[fragment_batch::size];
+            int count = 0;
+            for (int index = row * width; index < (row + 1) * width; ++index)
+            {
+                gbuffer_texel& texel = gbuffer[index];
+                if (!texel.covered)
+                {
+                    continue;
+                }
+                texel.covered = false;
+                for (int k = 0; k < 3; ++k)
+                {
+                    batch.view_pos[k][count] = texel.view_pos[k];
+                    batch.color[k][count] = texel.color[k];
+                    batch.normal[k][count] = texel.normal[k];
+                }
+                batch.tex_coords[0][count] = texel.tex_coords[0];
+                batch.tex_coords[1][count] = texel.tex_coords[1];
+                for (int k = 0; k < 2; ++k)
+                {
+                    batch.tex_dx[k][count] = texel.tex_dx[k];
+                    batch.tex_dy[k][count] = texel.tex_dy[k];
+                }
+                pixels[count++] = index;
+                if (count == fragment_batch::size)
+                {
+                    shade_batch(shader, batch, pixels, count);
+                    count = 0;
+                }
+            }
+            if (count > 0)
+            {
+                shade_batch(shader, batch, pixels, count);
+            }
+        });
+        frame_timings.shade += elapsed_ms(start);
+    }
+
+    template <typename Shader>
+    void rasterizer::shade_batch(const Shader& shader, fragment_batch& batch, const int* pixels, int count)
+    {
+        // Unused lanes repeat lane 0 so the shader never sees garbage (e.g. out of range uv).
+        for (int i = count; i < fragment_batch::size; ++i)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                batch.view_pos[k][i] = batch.view_pos[k][0];
+                batch.color[k][i] = batch.color[k][0];
+                batch.normal[k][i] = batch.normal[k][0];
+            }
+            for (int k = 0; k < 2; ++k)
+            {
+                batch.tex_coords[k][i] = batch.tex_coords[k][0];
+                batch.tex_dx[k][i] = batch.tex_dx[k][0];
+                batch.tex_dy[k][i] = batch.tex_dy[k][0];
+            }
+        }
+
+        shader(batch);
+
+        for (int i = 0; i < count; ++i)
+        {
+            frame_buf[pixels[i]] = {batch.result[0][i], batch.result[1][i], batch.result[2][i]};
+        }
+    }
 }
@@ -40,8 +40,8 @@ enum MaterialType
 
 inline float get_random_float()
 {
-    std::random_device dev;
-    std::mt19937 rng(dev());
+    // One generator per thread, created once with a fixed seed so that runs are repeatable
+    thread_local std::mt19937 rng(5489u);
     std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
 
     return dist(rng);
@@ -12,7 +12,16 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    // Build over bounds and centroids computed once, then reorder the primitives so that every
+    // leaf refers to a contiguous range of them
+    std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        primitiveInfo[i] = BVHPrimitiveInfo(i, primitives[i]->getBounds());
+
+    std::vector<Object*> orderedPrims;
+    orderedPrims.reserve(primitives.size());
+    root = recursiveBuild(primitiveInfo, 0, (int)primitives.size(), orderedPrims);
+    primitives.swap(orderedPrims);
 
     time(&stop);
     double diff = difftime(stop, start);
@@ -25,124 +34,111 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
         hrs, mins, secs);
 }
 
-static Bounds3 getCentroidBounds(const std::vector<Object*>& objects, unsigned begin, unsigned end)
-{
-    Bounds3 bounds;
-    size_t size = std::min(end, static_cast<unsigned>(objects.size()));
-    for (unsigned i = begin; i < size; ++i)
-    {
-        Object* object = objects[i];
-        if (!object)
-        {
-            continue;
-        }
-        bounds = Union(bounds, object->getBounds().Centroid());
-    }
-    return bounds;
-}
+// SAH cost of visiting an interior node, relative to intersecting one primitive
+static constexpr float traversalCost = 0.125f;
+static constexpr int nBuckets = 12;
 
-static unsigned getMiddle(BVHAccel::SplitMethod splitMethod, const std::vector<Object*>& objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                       std::vector<Object*>& orderedPrims)
 {
-    unsigned size = objects.size();
-    if (splitMethod != BVHAccel::SplitMethod::SAH)
-    {
-        return size / 2;
-    }
-
-    unsigned mid = 1u;
-    double time_max = std::numeric_limits<double>::max();
-    unsigned num_buckets = 31;
-    for (unsigned i = 1; i < num_buckets; ++i)
-    {
-        unsigned i_mid = size * i / num_buckets;
-        Bounds3 leftBounds = getCentroidBounds(objects, 0, i_mid);
-        Bounds3 rightBounds = getCentroidBounds(objects, i_mid, size);
-        double leftArea = leftBounds.SurfaceArea();
-        double rightArea = rightBounds.SurfaceArea();
-        double totalArea = leftArea + rightArea;
-        double inv_totalArea = 1.0 / totalArea;
-
-        double time = leftArea * inv_totalArea * i_mid + rightArea * inv_totalArea * (size - i_mid);
-        if (time < time_max)
-        {
-            time_max = time;
-            mid = i_mid;
-        }
-    }
-    return mid;
-}
-
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
-{
-    if (objects.empty())
-    {
-        return nullptr;
-    }
-
     BVHBuildNode* node = new BVHBuildNode();
 
     // Compute bounds of all primitives in BVH node
     Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
-        // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        return node;
-    }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
-
-        node->bounds = Union(node->left->bounds, node->right->bounds);
+    for (int i = start; i < end; ++i)
+        bounds = Union(bounds, primitiveInfo[i].bounds);
+    int nPrimitives = end - start;
+
+    auto createLeaf = [&]() {
+        node->bounds = bounds;
+        node->firstPrimOffset = (int)orderedPrims.size();
+        node->nPrimitives = nPrimitives;
+        for (int i = start; i < end; ++i)
+            orderedPrims.push_back(primitives[primitiveInfo[i].primitiveNumber]);
         return node;
+    };
+
+    if (nPrimitives == 1)
+        return createLeaf();
+
+    Bounds3 centroidBounds;
+    for (int i = start; i < end; ++i)
+        centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+    int dim = centroidBounds.maxExtent();
+    // All centroids coincide, nothing to split on
+    const Vector3f centroidExtent = centroidBounds.Diagonal();
+    if (centroidExtent[dim] == 0)
+        return createLeaf();
+
+    int mid = (start + end) / 2;
+    if (splitMethod == SplitMethod::NAIVE || nPrimitives <= 2) {
+        std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+                         [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
     }
     else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
-            break;
+        // Bin the centroids along the split axis, then sweep the buckets from both ends to get
+        // the cost of every split between them
+        struct BucketInfo {
+            int count = 0;
+            Bounds3 bounds;
+        };
+        BucketInfo buckets[nBuckets];
+        auto bucketOf = [&](const BVHPrimitiveInfo& info) {
+            const Vector3f offset = centroidBounds.Offset(info.centroid);
+            int b = (int)(nBuckets * offset[dim]);
+            return std::min(b, nBuckets - 1);
+        };
+        for (int i = start; i < end; ++i) {
+            BucketInfo& bucket = buckets[bucketOf(primitiveInfo[i])];
+            ++bucket.count;
+            bucket.bounds = Union(bucket.bounds, primitiveInfo[i].bounds);
         }
 
-        unsigned middle = getMiddle(splitMethod, objects);
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + middle;
-        auto ending = objects.end();
-
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+        float areaBelow[nBuckets - 1];
+        int countBelow[nBuckets - 1];
+        Bounds3 below;
+        int count = 0;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            below = Union(below, buckets[i].bounds);
+            count += buckets[i].count;
+            areaBelow[i] = count ? below.SurfaceArea() : 0;
+            countBelow[i] = count;
+        }
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+        float minCost = std::numeric_limits<float>::max();
+        int minCostSplitBucket = -1;
+        Bounds3 above;
+        count = 0;
+        for (int i = nBuckets - 1; i > 0; --i) {
+            above = Union(above, buckets[i].bounds);
+            count += buckets[i].count;
+            if (!count || !countBelow[i - 1])
+                continue;
+            float cost = countBelow[i - 1] * areaBelow[i - 1] + count * above.SurfaceArea();
+            if (cost < minCost) {
+                minCost = cost;
+                minCostSplitBucket = i - 1;
+            }
+        }
+        minCost = traversalCost + minCost / bounds.SurfaceArea();
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+        // Splitting does not pay off, so make a leaf if it is small enough
+        float leafCost = nPrimitives;
+        if (minCostSplitBucket < 0 || (nPrimitives <= maxPrimsInNode && leafCost <= minCost))
+            return createLeaf();
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
+        BVHPrimitiveInfo* pmid = std::partition(
+            &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+            [&](const BVHPrimitiveInfo& info) { return bucketOf(info) <= minCostSplitBucket; });
+        mid = (int)(pmid - &primitiveInfo[0]);
     }
 
+    node->splitAxis = dim;
+    node->left = recursiveBuild(primitiveInfo, start, mid, orderedPrims);
+    node->right = recursiveBuild(primitiveInfo, mid, end, orderedPrims);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
     return node;
 }
 
@@ -171,11 +167,16 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
 
     if (!node->left && !node->right)
     {
-        if (!node->object)
+        Intersection isect;
+        for (int i = 0; i < node->nPrimitives; ++i)
         {
-            return {};
+            Intersection hit = primitives[node->firstPrimOffset + i]->getIntersection(ray);
+            if (hit.happened && hit.distance < isect.distance)
+            {
+                isect = hit;
+            }
         }
-        return node->object->getIntersection(ray);
+        return isect;
     }
 
     Intersection hit1 = getIntersection(node->left, ray);
@@ -185,4 +186,31 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
         return hit1;
     }
     return hit2;
-}
\ No newline at end of file
+}
+
+bool BVHAccel::IntersectP(const Ray& ray, float tMax) const
+{
+    return root && intersectP(root, ray, tMax);
+}
+
+bool BVHAccel::intersectP(BVHBuildNode* node, const Ray& ray, float tMax) const
+{
+    const Vector3f& dir = ray.direction;
+    if (!node->bounds.IntersectP(ray, ray.direction_inv, {dir.x < 0, dir.y < 0, dir.z < 0}))
+    {
+        return false;
+    }
+
+    if (!node->left && !node->right)
+    {
+        for (int i = 0; i < node->nPrimitives; ++i)
+        {
+            if (primitives[node->firstPrimOffset + i]->intersectP(ray, tMax))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    return intersectP(node->left, ray, tMax) || intersectP(node->right, ray, tMax);
+}
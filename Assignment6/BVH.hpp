@@ -28,17 +28,20 @@ public:
     enum class SplitMethod { NAIVE, SAH };
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::SAH);
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 4, SplitMethod splitMethod = SplitMethod::SAH);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
     Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
-    bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    bool intersectP(BVHBuildNode* node, const Ray& ray, float tMax) const;
+    // Whether anything is hit closer than tMax. Stops at the first hit found.
+    bool IntersectP(const Ray &ray, float tMax = std::numeric_limits<float>::infinity()) const;
+    BVHBuildNode* root = nullptr;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                 std::vector<Object*>& orderedPrims);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
@@ -46,19 +49,28 @@ public:
     std::vector<Object*> primitives;
 };
 
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3& bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+          centroid(0.5f * bounds.pMin + 0.5f * bounds.pMax) {}
+    size_t primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
 struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
-    Object* object;
 
 public:
+    // Leaves cover primitives [firstPrimOffset, firstPrimOffset + nPrimitives) in leaf order
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
     // BVHBuildNode Public Methods
     BVHBuildNode(){
         bounds = Bounds3();
         left = nullptr;right = nullptr;
-        object = nullptr;
     }
 };
 
@@ -15,6 +15,11 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
+bool Scene::occluded(const Ray &ray, float tMax) const
+{
+    return this->bvh->IntersectP(ray, tMax);
+}
+
 bool Scene::trace(
         const Ray &ray,
         const std::vector<Object*> &objects,
@@ -129,7 +134,7 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
                         Object *shadowHitObject = nullptr;
                         float tNearShadow = kInfinity;
                         // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                        bool inShadow = bvh->Intersect(Ray(shadowPointOrig, lightDir)).happened;
+                        bool inShadow = occluded(Ray(shadowPointOrig, lightDir), std::sqrt(lightDistance2));
                         lightAmt += (1 - inShadow) * get_lights()[i]->intensity * LdotN;
                         Vector3f reflectionDirection = reflect(-lightDir, N);
                         specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, ray.direction)),
@@ -32,6 +32,8 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    // Shadow ray query: whether anything blocks ray before tMax
+    bool occluded(const Ray& ray, float tMax) const;
     BVHAccel *bvh;
     void buildBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
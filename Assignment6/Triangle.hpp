@@ -60,6 +60,7 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    bool intersectP(const Ray& ray, float tMax) override;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -175,6 +176,11 @@ public:
                     Vector3f(0.937, 0.937, 0.231), pattern);
     }
 
+    bool intersectP(const Ray& ray, float tMax)
+    {
+        return bvh && bvh->IntersectP(ray, tMax);
+    }
+
     Intersection getIntersection(Ray ray)
     {
         Intersection intersec;
@@ -240,6 +246,29 @@ inline Intersection Triangle::getIntersection(Ray ray)
     return inter;
 }
 
+// Same test as getIntersection, for hits in [0, tMax)
+inline bool Triangle::intersectP(const Ray& ray, float tMax)
+{
+    if (dotProduct(ray.direction, normal) > 0)
+        return false;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    double det = dotProduct(e1, pvec);
+    if (fabs(det) < EPSILON)
+        return false;
+
+    double det_inv = 1. / det;
+    Vector3f tvec = ray.origin - v0;
+    double u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    double v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    double t = dotProduct(e2, qvec) * det_inv;
+    return t >= 0 && t < tMax;
+}
+
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 {
     return Vector3f(0.5, 0.5, 0.5);
@@ -0,0 +1,96 @@
+//
+// Constant-time sampling of a discrete distribution.
+//
+
+#ifndef RAYTRACING_ALIASTABLE_H
+#define RAYTRACING_ALIASTABLE_H
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+// Walker's alias method, built with Vose's algorithm. Every bin holds one outcome with
+// probability q and an alias for the rest, so a sample is one bin lookup and one
+// comparison however many outcomes there are.
+class AliasTable
+{
+public:
+    AliasTable() = default;
+    // Outcome i gets probability weights[i] / sum of weights. Weights must not be negative.
+    explicit AliasTable(const std::vector<float>& weights)
+    {
+        double sum = 0;
+        for (float w : weights)
+            sum += w;
+        int n = (int)weights.size();
+        bins.resize(n);
+        if (n == 0 || sum <= 0) {
+            bins.clear();
+            return;
+        }
+
+        std::vector<int> under, over;
+        std::vector<double> scaled(n);
+        for (int i = 0; i < n; ++i) {
+            bins[i].p = (float)(weights[i] / sum);
+            scaled[i] = weights[i] / sum * n;
+            (scaled[i] < 1 ? under : over).push_back(i);
+        }
+        // Fill each underfull bin up to 1 with part of an overfull one
+        while (!under.empty() && !over.empty()) {
+            int u = under.back(), o = over.back();
+            under.pop_back();
+            over.pop_back();
+            bins[u].q = (float)scaled[u];
+            bins[u].alias = o;
+            scaled[o] -= 1 - scaled[u];
+            (scaled[o] < 1 ? under : over).push_back(o);
+        }
+        // Whatever is left is 1 up to rounding
+        for (int i : under) {
+            bins[i].q = 1;
+            bins[i].alias = i;
+        }
+        for (int i : over) {
+            bins[i].q = 1;
+            bins[i].alias = i;
+        }
+    }
+
+    size_t size() const { return bins.size(); }
+    float PMF(int i) const { return bins[i].p; }
+
+    // Outcome for u in [0, 1), with its probability in pmf. The part of u not needed for
+    // the choice is returned rescaled to [0, 1) in uRemapped, so it can be used again. The
+    // table must not be empty, i.e. some weight must have been positive.
+    int Sample(float u, float* pmf = nullptr, float* uRemapped = nullptr) const
+    {
+        assert(!bins.empty());
+        int n = (int)bins.size();
+        int offset = std::min((int)(u * n), n - 1);
+        float up = std::min(u * n - offset, 0x1.fffffep-1f);
+        const Bin& bin = bins[offset];
+        int i = offset;
+        if (up < bin.q) {
+            if (uRemapped)
+                *uRemapped = std::min(up / bin.q, 0x1.fffffep-1f);
+        }
+        else {
+            i = bin.alias;
+            if (uRemapped)
+                *uRemapped = std::min((up - bin.q) / (1 - bin.q), 0x1.fffffep-1f);
+        }
+        if (pmf)
+            *pmf = bins[i].p;
+        return i;
+    }
+
+private:
+    struct Bin {
+        float q = 0, p = 0;
+        int alias = 0;
+    };
+    std::vector<Bin> bins;
+};
+
+#endif // RAYTRACING_ALIASTABLE_H
@@ -21,8 +21,7 @@ public:
 
     Vector3f SamplePoint() const
     {
-        auto random_u = get_random_float();
-        auto random_v = get_random_float();
+        auto [random_u, random_v] = get_random_float2();
         return position + random_u * u + random_v * v;
     }
 
@@ -1,155 +1,790 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <future>
+#include <thread>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "BVH.hpp"
 
+// Subtrees with at least this many primitives are built on their own thread, down to
+// parallelBuildDepth levels below the root
+static constexpr size_t parallelBuildPrims = 4096;
+static const int parallelBuildDepth = [] {
+    int depth = 1;
+    while ((1u << depth) < std::max(1u, std::thread::hardware_concurrency()))
+        ++depth;
+    return depth + 1;
+}();
+
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
-                   SplitMethod splitMethod)
+                   SplitMethod splitMethod, NodeLayout layout)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      layout(layout), primitives(std::move(p))
+{
+    build();
+}
+
+BVHAccel::BVHAccel(const TriangleMesh* mesh, int maxPrimsInNode,
+                   SplitMethod splitMethod, NodeLayout layout)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
-      primitives(std::move(p))
+      layout(layout), mesh(mesh)
 {
-    time_t start, stop;
-    time(&start);
-    if (primitives.empty())
+    build();
+}
+
+BVHAccel::~BVHAccel() = default;
+
+Bounds3 BVHAccel::WorldBound() const
+{
+    return root ? root->bounds : Bounds3();
+}
+
+void BVHAccel::Rebuild(std::vector<Object*> p)
+{
+    primitives = std::move(p);
+    root = nullptr;
+    buildNodes = nullptr;
+    totalNodes = 0;
+    nodes.clear();
+    qnodes.clear();
+    orderedPrims.clear();
+    for (int axis = 0; axis < 3; ++axis) {
+        orderedTris.v0[axis].clear();
+        orderedTris.e1[axis].clear();
+        orderedTris.e2[axis].clear();
+    }
+    stats = BVHBuildStats();
+    arena.Reset();
+    build();
+}
+
+void BVHAccel::Refit()
+{
+    if (mesh || orderedPrims.empty())
         return;
+    auto start = std::chrono::steady_clock::now();
+    auto leafBounds = [this](int offset, int count) {
+        Bounds3 bounds;
+        for (int i = offset; i < offset + count; ++i)
+            bounds = Union(bounds, orderedPrims[i]->getBounds());
+        return bounds;
+    };
 
-    root = recursiveBuild(primitives);
+    // Flattening places children after their parent, so a backwards pass sees children first
+    if (layout == NodeLayout::Quad) {
+        std::vector<Bounds3> nodeBounds(qnodes.size());
+        for (int n = (int)qnodes.size() - 1; n >= 0; --n) {
+            QBVHNode& qnode = qnodes[n];
+            for (int i = 0; i < qnode.nChildren; ++i) {
+                int child = qnode.child[i];
+                Bounds3 b = child > 0 ? nodeBounds[child] : leafBounds(~child, qnode.nPrims[i]);
+                qnode.bounds[0][0][i] = b.pMin.x;
+                qnode.bounds[0][1][i] = b.pMin.y;
+                qnode.bounds[0][2][i] = b.pMin.z;
+                qnode.bounds[1][0][i] = b.pMax.x;
+                qnode.bounds[1][1][i] = b.pMax.y;
+                qnode.bounds[1][2][i] = b.pMax.z;
+                nodeBounds[n] = Union(nodeBounds[n], b);
+            }
+        }
+        root->bounds = nodeBounds[0];
+    }
+    else {
+        for (int n = (int)nodes.size() - 1; n >= 0; --n) {
+            LinearBVHNode& node = nodes[n];
+            if (node.nPrimitives > 0)
+                node.bounds = leafBounds(node.primitivesOffset, node.nPrimitives);
+            else
+                node.bounds = Union(nodes[n + 1].bounds, nodes[node.secondChildOffset].bounds);
+        }
+        root->bounds = nodes[0].bounds;
+    }
+    stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BVHAccel::build()
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t nPrimitives = mesh ? mesh->triangleCount() : primitives.size();
+    if (nPrimitives == 0)
+        return;
+
+    std::vector<BVHPrimitiveInfo> primitiveInfo(nPrimitives);
+    for (size_t i = 0; i < nPrimitives; ++i)
+        primitiveInfo[i] = BVHPrimitiveInfo(i, mesh ? mesh->bounds(i) : primitives[i]->getBounds());
+
+    // Every leaf holds at least one primitive, so the tree has at most 2n - 1 nodes
+    buildNodes = arena.Alloc<BVHBuildNode>(2 * nPrimitives - 1);
+    root = recursiveBuild(primitiveInfo, 0, (int)nPrimitives);
+
+    // The build partitioned primitiveInfo in place, leaving it in leaf order
+    if (mesh) {
+        for (int axis = 0; axis < 3; ++axis) {
+            orderedTris.v0[axis].resize(nPrimitives + 3);
+            orderedTris.e1[axis].resize(nPrimitives + 3);
+            orderedTris.e2[axis].resize(nPrimitives + 3);
+        }
+        for (size_t i = 0; i < nPrimitives; ++i) {
+            Vector3f v0, v1, v2;
+            mesh->triangle(primitiveInfo[i].primitiveNumber, v0, v1, v2);
+            Vector3f e1 = v1 - v0, e2 = v2 - v0;
+            const float* coords[3] = { &v0.x, &e1.x, &e2.x };
+            for (int axis = 0; axis < 3; ++axis) {
+                orderedTris.v0[axis][i] = coords[0][axis];
+                orderedTris.e1[axis][i] = coords[1][axis];
+                orderedTris.e2[axis][i] = coords[2][axis];
+            }
+        }
+    }
+    else {
+        orderedPrims.resize(nPrimitives);
+        for (size_t i = 0; i < nPrimitives; ++i)
+            orderedPrims[i] = primitives[primitiveInfo[i].primitiveNumber];
+    }
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+    if (layout == NodeLayout::Quad) {
+        flattenQBVHTree(root);
+    }
+    else {
+        int offset = 0;
+        nodes.resize(totalNodes);
+        flattenBVHTree(root, &offset);
+    }
 
-    printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-        hrs, mins, secs);
+    stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stats.nodes = totalNodes;
+    stats.primitives = (int)nPrimitives;
+    stats.bytes = arena.TotalAllocated() + nodes.size() * sizeof(LinearBVHNode) +
+                  qnodes.size() * sizeof(QBVHNode) + orderedPrims.size() * sizeof(Object*) +
+                  9 * orderedTris.v0[0].size() * sizeof(float);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                       int depth)
 {
-    BVHBuildNode* node = new BVHBuildNode();
+    BVHBuildNode* node = &buildNodes[totalNodes++];
 
     // Compute bounds of all primitives in BVH node
     Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
+    for (int i = start; i < end; ++i)
+        bounds = Union(bounds, primitiveInfo[i].bounds);
+    int nPrimitives = end - start;
+    if (nPrimitives <= maxPrimsInNode) {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
+        node->bounds = bounds;
+        node->firstPrimOffset = start;
+        node->nPrimitives = nPrimitives;
         return node;
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
-        return node;
+    // Split at the median centroid along the widest axis. The near half goes left, which
+    // is the child the traversal visits first for rays along +axis.
+    Bounds3 centroidBounds;
+    for (int i = start; i < end; ++i)
+        centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+    int dim = centroidBounds.maxExtent();
+    node->splitAxis = dim;
+    int mid = start + nPrimitives / 2;
+    std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+                     [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                         return a.centroid[dim] < b.centroid[dim];
+                     });
+
+    // The halves are disjoint ranges of primitiveInfo, so they can be built concurrently
+    if (depth < parallelBuildDepth && nPrimitives >= (int)parallelBuildPrims) {
+        auto left = std::async(std::launch::async, [&] { return recursiveBuild(primitiveInfo, start, mid, depth + 1); });
+        node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1);
+        node->left = left.get();
     }
     else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
+        node->left = recursiveBuild(primitiveInfo, start, mid, depth + 1);
+        node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1);
+    }
+
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+int BVHAccel::flattenBVHTree(BVHBuildNode* node, int* offset)
+{
+    LinearBVHNode* linearNode = &nodes[*offset];
+    linearNode->bounds = node->bounds;
+    int myOffset = (*offset)++;
+    if (!node->left && !node->right) {
+        linearNode->primitivesOffset = node->firstPrimOffset;
+        linearNode->nPrimitives = node->nPrimitives;
+    }
+    else {
+        linearNode->axis = node->splitAxis;
+        linearNode->nPrimitives = 0;
+        flattenBVHTree(node->left, offset);
+        linearNode->secondChildOffset = flattenBVHTree(node->right, offset);
+    }
+    return myOffset;
+}
+
+int BVHAccel::flattenQBVHTree(BVHBuildNode* node)
+{
+    // Open up the largest interior children until there are four of them
+    BVHBuildNode* children[4] = { node, nullptr, nullptr, nullptr };
+    int n = 1;
+    if (node->left && node->right) {
+        children[0] = node->left;
+        children[1] = node->right;
+        n = 2;
+    }
+    while (n < 4) {
+        int largest = -1;
+        double largestArea = -1;
+        for (int i = 0; i < n; ++i) {
+            if (children[i]->left && children[i]->bounds.SurfaceArea() > largestArea) {
+                largest = i;
+                largestArea = children[i]->bounds.SurfaceArea();
+            }
+        }
+        if (largest < 0)
             break;
+        BVHBuildNode* opened = children[largest];
+        children[largest] = opened->left;
+        children[n++] = opened->right;
+    }
+
+    int index = (int)qnodes.size();
+    qnodes.emplace_back();
+    QBVHNode& qnode = qnodes[index];
+    qnode.nChildren = n;
+    const float inf = std::numeric_limits<float>::infinity();
+    for (int i = 0; i < 4; ++i) {
+        // Unused slots get an empty box that no ray enters
+        Vector3f pMin = i < n ? children[i]->bounds.pMin : Vector3f(inf);
+        Vector3f pMax = i < n ? children[i]->bounds.pMax : Vector3f(-inf);
+        qnode.bounds[0][0][i] = pMin.x;
+        qnode.bounds[0][1][i] = pMin.y;
+        qnode.bounds[0][2][i] = pMin.z;
+        qnode.bounds[1][0][i] = pMax.x;
+        qnode.bounds[1][1][i] = pMax.y;
+        qnode.bounds[1][2][i] = pMax.z;
+        qnode.child[i] = 0;
+        qnode.nPrims[i] = 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        int child;
+        if (children[i]->left && children[i]->right) {
+            child = flattenQBVHTree(children[i]);
+        }
+        else {
+            child = ~children[i]->firstPrimOffset;
+            qnodes[index].nPrims[i] = children[i]->nPrimitives;
         }
+        // The recursion may have grown qnodes, so index again
+        qnodes[index].child[i] = child;
+    }
+    return index;
+}
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+namespace {
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+// Ray data broadcast once for the slab tests against QBVH nodes
+struct QBVHRay {
+#if defined(__SSE2__)
+    __m128 origin[3], invDir[3];
+#else
+    float origin[3], invDir[3];
+#endif
+    int dirIsNeg[3];
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+    explicit QBVHRay(const Ray& ray)
+    {
+        const float o[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+        const float inv[3] = { ray.direction_inv.x, ray.direction_inv.y, ray.direction_inv.z };
+        for (int axis = 0; axis < 3; ++axis) {
+#if defined(__SSE2__)
+            origin[axis] = _mm_set1_ps(o[axis]);
+            invDir[axis] = _mm_set1_ps(inv[axis]);
+#else
+            origin[axis] = o[axis];
+            invDir[axis] = inv[axis];
+#endif
+            dirIsNeg[axis] = inv[axis] < 0;
+        }
+    }
+};
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+// Tests the ray against the four child boxes of node at once, with the same rules as
+// Bounds3::IntersectP. Writes the entry distances and returns one bit per child hit.
+inline int intersectChildren(const QBVHNode& node, const QBVHRay& ray, float tMax, float tEnter[4])
+{
+#if defined(__SSE2__)
+    __m128 enter = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    __m128 exit = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 tNear = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.dirIsNeg[axis]][axis]), ray.origin[axis]),
+                                  ray.invDir[axis]);
+        __m128 tFar = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - ray.dirIsNeg[axis]][axis]), ray.origin[axis]),
+                                 ray.invDir[axis]);
+        enter = _mm_max_ps(enter, tNear);
+        exit = _mm_min_ps(exit, tFar);
+    }
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(enter, exit),
+                            _mm_and_ps(_mm_cmpge_ps(exit, _mm_setzero_ps()), _mm_cmple_ps(enter, _mm_set1_ps(tMax))));
+    _mm_storeu_ps(tEnter, enter);
+    return _mm_movemask_ps(hit) & ((1 << node.nChildren) - 1);
+#else
+    int mask = 0;
+    for (int i = 0; i < node.nChildren; ++i) {
+        float enter = -std::numeric_limits<float>::infinity();
+        float exit = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; ++axis) {
+            float tNear = (node.bounds[ray.dirIsNeg[axis]][axis][i] - ray.origin[axis]) * ray.invDir[axis];
+            float tFar = (node.bounds[1 - ray.dirIsNeg[axis]][axis][i] - ray.origin[axis]) * ray.invDir[axis];
+            enter = std::max(enter, tNear);
+            exit = std::min(exit, tFar);
+        }
+        tEnter[i] = enter;
+        if (enter <= exit && exit >= 0 && enter <= tMax)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+// Tests child c of node against the four rays of a packet starting at lane first, with the
+// same rules as Bounds3::IntersectP. Writes their entry distances and returns one bit per
+// ray that hits.
+inline int intersectBox(const QBVHNode& node, int c, const float origin[3][kMaxPacketSize],
+                        const float invDir[3][kMaxPacketSize], const float tMax[kMaxPacketSize],
+                        int first, float enter[4])
+{
+#if defined(__SSE2__)
+    __m128 tEnter = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    __m128 tExit = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 o = _mm_load_ps(&origin[axis][first]);
+        __m128 inv = _mm_load_ps(&invDir[axis][first]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[0][axis][c]), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[1][axis][c]), o), inv);
+        // Rays along -axis enter through the max plane
+        __m128 neg = _mm_cmplt_ps(inv, _mm_setzero_ps());
+        __m128 tNear = _mm_or_ps(_mm_and_ps(neg, t1), _mm_andnot_ps(neg, t0));
+        __m128 tFar = _mm_or_ps(_mm_and_ps(neg, t0), _mm_andnot_ps(neg, t1));
+        tEnter = _mm_max_ps(tEnter, tNear);
+        tExit = _mm_min_ps(tExit, tFar);
     }
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(tEnter, tExit),
+                            _mm_and_ps(_mm_cmpge_ps(tExit, _mm_setzero_ps()),
+                                       _mm_cmple_ps(tEnter, _mm_load_ps(&tMax[first]))));
+    _mm_store_ps(enter, tEnter);
+    return _mm_movemask_ps(hit);
+#else
+    int mask = 0;
+    for (int l = 0; l < 4; ++l) {
+        int i = first + l;
+        float tEnter = -std::numeric_limits<float>::infinity();
+        float tExit = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; ++axis) {
+            int neg = invDir[axis][i] < 0;
+            float tNear = (node.bounds[neg][axis][c] - origin[axis][i]) * invDir[axis][i];
+            float tFar = (node.bounds[1 - neg][axis][c] - origin[axis][i]) * invDir[axis][i];
+            tEnter = std::max(tEnter, tNear);
+            tExit = std::min(tExit, tFar);
+        }
+        enter[l] = tEnter;
+        if (tEnter <= tExit && tExit >= 0 && tEnter <= tMax[i])
+            mask |= 1 << l;
+    }
+    return mask;
+#endif
+}
 
-    return node;
+// Moller-Trumbore against the four triangles of tris starting at first, with the rules of
+// Triangle::getIntersection: back faces and hits behind the origin miss. Writes the hit
+// distances and returns one bit per triangle hit closer than tMax.
+inline int intersectTriangles(const LeafTriangles& tris, int first, const Ray& ray, float tMax, float t[4])
+{
+#if defined(__SSE2__)
+    __m128 d[3] = { _mm_set1_ps(ray.direction.x), _mm_set1_ps(ray.direction.y), _mm_set1_ps(ray.direction.z) };
+    __m128 e1[3], e2[3], tvec[3];
+    const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    for (int axis = 0; axis < 3; ++axis) {
+        e1[axis] = _mm_loadu_ps(&tris.e1[axis][first]);
+        e2[axis] = _mm_loadu_ps(&tris.e2[axis][first]);
+        tvec[axis] = _mm_sub_ps(_mm_set1_ps(origin[axis]), _mm_loadu_ps(&tris.v0[axis][first]));
+    }
+    auto cross = [](const __m128 a[3], const __m128 b[3], __m128 c[3]) {
+        c[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+        c[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+        c[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+    };
+    auto dot = [](const __m128 a[3], const __m128 b[3]) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+    };
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+
+    __m128 pvec[3], qvec[3];
+    cross(d, e2, pvec);
+    __m128 det = dot(e1, pvec);
+    // A negative determinant is a back face
+    __m128 valid = _mm_cmpge_ps(det, _mm_set1_ps(EPSILON));
+    __m128 detInv = _mm_div_ps(one, det);
+    __m128 u = _mm_mul_ps(dot(tvec, pvec), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+    cross(tvec, e1, qvec);
+    __m128 v = _mm_mul_ps(dot(d, qvec), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+    __m128 tHit = _mm_mul_ps(dot(e2, qvec), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tHit, zero), _mm_cmplt_ps(tHit, _mm_set1_ps(tMax))));
+    _mm_storeu_ps(t, tHit);
+    return _mm_movemask_ps(valid);
+#else
+    int mask = 0;
+    for (int l = 0; l < 4; ++l) {
+        int i = first + l;
+        Vector3f e1(tris.e1[0][i], tris.e1[1][i], tris.e1[2][i]);
+        Vector3f e2(tris.e2[0][i], tris.e2[1][i], tris.e2[2][i]);
+        Vector3f pvec = crossProduct(ray.direction, e2);
+        float det = dotProduct(e1, pvec);
+        if (!(det >= EPSILON))
+            continue;
+        float detInv = 1.f / det;
+        Vector3f tvec = ray.origin - Vector3f(tris.v0[0][i], tris.v0[1][i], tris.v0[2][i]);
+        float u = dotProduct(tvec, pvec) * detInv;
+        if (u < 0 || u > 1)
+            continue;
+        Vector3f qvec = crossProduct(tvec, e1);
+        float v = dotProduct(ray.direction, qvec) * detInv;
+        if (v < 0 || u + v > 1)
+            continue;
+        t[l] = dotProduct(e2, qvec) * detInv;
+        if (t[l] >= 0 && t[l] < tMax)
+            mask |= 1 << l;
+    }
+    return mask;
+#endif
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const
+} // namespace
+
+void BVHAccel::intersectLeaf(int offset, int count, const Ray& ray, Intersection& isect) const
 {
-    Intersection isect;
-    if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+    if (!mesh) {
+        for (int i = offset; i < offset + count; ++i) {
+            Intersection hit = orderedPrims[i]->getIntersection(ray);
+            if (hit.happened && hit.distance < isect.distance)
+                isect = hit;
+        }
+        return;
+    }
+
+    float tClosest = isect.happened ? (float)isect.distance : std::numeric_limits<float>::infinity();
+    int closest = -1;
+    for (int i = 0; i < count; i += 4) {
+        float t[4];
+        int mask = intersectTriangles(orderedTris, offset + i, ray, tClosest, t);
+        mask &= (1 << std::min(4, count - i)) - 1;
+        for (int l = 0; l < 4; ++l) {
+            if ((mask & (1 << l)) && t[l] < tClosest) {
+                tClosest = t[l];
+                closest = offset + i + l;
+            }
+        }
+    }
+    if (closest < 0)
+        return;
+
+    const LeafTriangles& tris = orderedTris;
+    Vector3f e1(tris.e1[0][closest], tris.e1[1][closest], tris.e1[2][closest]);
+    Vector3f e2(tris.e2[0][closest], tris.e2[1][closest], tris.e2[2][closest]);
+    isect.happened = true;
+    isect.coords = ray(tClosest);
+    isect.normal = normalize(crossProduct(e1, e2));
+    isect.m = mesh->m;
+    isect.obj = mesh->owner;
+    isect.distance = tClosest;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+void BVHAccel::intersectLeafPacket(int offset, int count, const Ray* rays, Intersection* hits,
+                                   uint32_t mask) const
 {
-    // Traverse the BVH to find intersection
-    if (!node)
-    {
-        return {};
+    if (!mesh) {
+        for (int i = offset; i < offset + count; ++i)
+            orderedPrims[i]->getIntersections(rays, hits, mask);
+        return;
     }
+    for (int i = 0; i < kMaxPacketSize; ++i) {
+        if (mask & (1u << i))
+            intersectLeaf(offset, count, rays[i], hits[i]);
+    }
+}
 
-    const Vector3f& dir = ray.direction;
-    if (!node->bounds.IntersectP(ray, ray.direction_inv, { dir.x < 0, dir.y < 0, dir.z < 0 }))
-    {
-        return {};
+bool BVHAccel::intersectLeafP(int offset, int count, const Ray& ray, float tMax) const
+{
+    if (!mesh) {
+        for (int i = offset; i < offset + count; ++i) {
+            if (orderedPrims[i]->intersectP(ray, tMax))
+                return true;
+        }
+        return false;
+    }
+    for (int i = 0; i < count; i += 4) {
+        float t[4];
+        if (intersectTriangles(orderedTris, offset + i, ray, tMax, t) & ((1 << std::min(4, count - i)) - 1))
+            return true;
     }
+    return false;
+}
 
-    if (!node->left && !node->right)
-    {
-        if (!node->object)
-        {
-            return {};
+void BVHAccel::intersectQBVH(const Ray& ray, int start, int nPrims, Intersection& isect) const
+{
+    QBVHRay qray(ray);
+    float tClosest = isect.happened ? (float)isect.distance : std::numeric_limits<float>::infinity();
+
+    // Children still to visit with their entry distance, nearest on top
+    struct StackEntry {
+        int child;
+        int nPrims;
+        float t;
+    };
+    StackEntry stack[256];
+    int stackSize = 0;
+    stack[stackSize++] = { start, nPrims, 0.f };
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.t > tClosest)
+            continue;
+
+        if (entry.child < 0) {
+            intersectLeaf(~entry.child, entry.nPrims, ray, isect);
+            if (isect.happened)
+                tClosest = (float)isect.distance;
+            continue;
         }
-        return node->object->getIntersection(ray);
+
+        const QBVHNode& node = qnodes[entry.child];
+        float tEnter[4];
+        int mask = intersectChildren(node, qray, tClosest, tEnter);
+
+        // Sort the hit children far to near, so the nearest is popped first
+        StackEntry hits[4];
+        int nHits = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            StackEntry e = { node.child[i], node.nPrims[i], tEnter[i] };
+            int j = nHits++;
+            for (; j > 0 && hits[j - 1].t < e.t; --j)
+                hits[j] = hits[j - 1];
+            hits[j] = e;
+        }
+        for (int i = 0; i < nHits; ++i)
+            stack[stackSize++] = hits[i];
     }
+}
 
-    Intersection hit_left = getIntersection(node->left, ray);
-    Intersection hit_right = getIntersection(node->right, ray);
-    if (hit_left.distance <= hit_right.distance)
-    {
-        return hit_left;
+void BVHAccel::IntersectPacket(const Ray* rays, Intersection* hits, uint32_t mask) const
+{
+    if (layout != NodeLayout::Quad) {
+        for (int i = 0; i < kMaxPacketSize; ++i) {
+            if (!(mask & (1u << i)))
+                continue;
+            Intersection hit = Intersect(rays[i]);
+            if (hit.happened && hit.distance < hits[i].distance)
+                hits[i] = hit;
+        }
+        return;
+    }
+    if (qnodes.empty() || !mask)
+        return;
+
+    // The packet in SoA layout, four rays per SIMD group. Lanes outside mask are never
+    // read back.
+    constexpr int nGroups = kMaxPacketSize / 4;
+    alignas(16) float origin[3][kMaxPacketSize], invDir[3][kMaxPacketSize], tMax[kMaxPacketSize];
+    for (int i = 0; i < kMaxPacketSize; ++i) {
+        const Ray& ray = rays[(mask & (1u << i)) ? i : __builtin_ctz(mask)];
+        origin[0][i] = ray.origin.x;
+        origin[1][i] = ray.origin.y;
+        origin[2][i] = ray.origin.z;
+        invDir[0][i] = ray.direction_inv.x;
+        invDir[1][i] = ray.direction_inv.y;
+        invDir[2][i] = ray.direction_inv.z;
+        tMax[i] = (mask & (1u << i)) && hits[i].happened ? (float)hits[i].distance
+                                                          : std::numeric_limits<float>::infinity();
+    }
+
+    struct StackEntry {
+        int child;
+        int nPrims;
+        uint32_t mask;
+        float t;
+    };
+    StackEntry stack[256];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, 0, mask, 0.f };
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        uint32_t active = entry.mask;
+
+        // Too few rays left to fill a SIMD group, trace them one at a time
+        if (__builtin_popcount(active) < 4) {
+            for (int i = 0; i < kMaxPacketSize; ++i) {
+                if (!(active & (1u << i)))
+                    continue;
+                intersectQBVH(rays[i], entry.child, entry.nPrims, hits[i]);
+                if (hits[i].happened)
+                    tMax[i] = (float)hits[i].distance;
+            }
+            continue;
+        }
+
+        if (entry.child < 0) {
+            intersectLeafPacket(~entry.child, entry.nPrims, rays, hits, active);
+            for (int i = 0; i < kMaxPacketSize; ++i) {
+                if ((active & (1u << i)) && hits[i].happened)
+                    tMax[i] = (float)hits[i].distance;
+            }
+            continue;
+        }
+
+        // Test every child box against the active rays, four rays per pass
+        const QBVHNode& node = qnodes[entry.child];
+        StackEntry children[4];
+        int nChildren = 0;
+        for (int c = 0; c < node.nChildren; ++c) {
+            uint32_t childMask = 0;
+            float tNearest = std::numeric_limits<float>::infinity();
+            for (int g = 0; g < nGroups; ++g) {
+                if (!((active >> (4 * g)) & 0xf))
+                    continue;
+                alignas(16) float enter[4];
+                int lanes = intersectBox(node, c, origin, invDir, tMax, 4 * g, enter);
+                lanes &= (active >> (4 * g)) & 0xf;
+                childMask |= (uint32_t)lanes << (4 * g);
+                for (int l = 0; l < 4; ++l) {
+                    if (lanes & (1 << l))
+                        tNearest = std::min(tNearest, enter[l]);
+                }
+            }
+            if (!childMask)
+                continue;
+
+            // Keep the children sorted far to near by the nearest entry of any ray
+            StackEntry e = { node.child[c], node.nPrims[c], childMask, tNearest };
+            int j = nChildren++;
+            for (; j > 0 && children[j - 1].t < e.t; --j)
+                children[j] = children[j - 1];
+            children[j] = e;
+        }
+        for (int i = 0; i < nChildren; ++i)
+            stack[stackSize++] = children[i];
     }
-    return hit_right;
 }
 
+Intersection BVHAccel::Intersect(const Ray& ray) const
+{
+    if (layout == NodeLayout::Quad) {
+        Intersection isect;
+        if (!qnodes.empty())
+            intersectQBVH(ray, 0, 0, isect);
+        return isect;
+    }
+
+    Intersection isect;
+    if (nodes.empty())
+        return isect;
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
-        return;
+    const Vector3f& dir = ray.direction;
+    std::array<int, 3> dirIsNeg = { dir.x < 0, dir.y < 0, dir.z < 0 };
+
+    // Visit the near child first and skip every node entered beyond the closest hit so far
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, isect.distance)) {
+            if (node->nPrimitives > 0) {
+                intersectLeaf(node->primitivesOffset, node->nPrimitives, ray, isect);
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else if (dirIsNeg[node->axis]) {
+                nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                currentNodeIndex = node->secondChildOffset;
+            }
+            else {
+                nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                currentNodeIndex = currentNodeIndex + 1;
+            }
+        }
+        else {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
     }
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
+    return isect;
 }
 
-void BVHAccel::Sample(Intersection &pos, float &pdf){
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+bool BVHAccel::IntersectP(const Ray& ray, float tMax) const
+{
+    // Any hit will do, so children are visited in whatever order they come
+    if (layout == NodeLayout::Quad) {
+        if (qnodes.empty())
+            return false;
+        QBVHRay qray(ray);
+        int stack[256], stackPrims[256];
+        int stackSize = 0;
+        stack[stackSize] = 0;
+        stackPrims[stackSize++] = 0;
+        while (stackSize > 0) {
+            --stackSize;
+            int child = stack[stackSize];
+            if (child < 0) {
+                if (intersectLeafP(~child, stackPrims[stackSize], ray, tMax))
+                    return true;
+                continue;
+            }
+            const QBVHNode& node = qnodes[child];
+            float tEnter[4];
+            int mask = intersectChildren(node, qray, tMax, tEnter);
+            for (int i = 0; i < 4; ++i) {
+                if (mask & (1 << i)) {
+                    stack[stackSize] = node.child[i];
+                    stackPrims[stackSize++] = node.nPrims[i];
+                }
+            }
+        }
+        return false;
+    }
+
+    if (nodes.empty())
+        return false;
+    const Vector3f& dir = ray.direction;
+    std::array<int, 3> dirIsNeg = { dir.x < 0, dir.y < 0, dir.z < 0 };
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, tMax)) {
+            if (node->nPrimitives > 0) {
+                if (intersectLeafP(node->primitivesOffset, node->nPrimitives, ray, tMax))
+                    return true;
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                currentNodeIndex = currentNodeIndex + 1;
+            }
+        }
+        else {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return false;
+}
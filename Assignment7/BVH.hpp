@@ -8,16 +8,42 @@
 #include <atomic>
 #include <vector>
 #include <memory>
-#include <ctime>
+#include <cstdint>
+#include <ostream>
 #include "Object.hpp"
 #include "Ray.hpp"
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
+#include "MemoryArena.hpp"
+#include "TriangleMesh.hpp"
 #include "Vector.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct LinearBVHNode;
+struct QBVHNode;
+
+// Triangles of a mesh BVH in leaf order, with one array per coordinate of the first vertex
+// and the two edges. Padded with three unused entries so that a SIMD pass may read four
+// triangles from any offset.
+struct LeafTriangles {
+    std::vector<float> v0[3], e1[3], e2[3];
+};
+
+// Cost of a BVH build, filled in by the constructor
+struct BVHBuildStats {
+    double buildMs = 0;
+    int nodes = 0;
+    int primitives = 0;
+    size_t bytes = 0; // node arena, flattened nodes and ordered primitives
+};
+
+inline std::ostream& operator<<(std::ostream& os, const BVHBuildStats& stats)
+{
+    return os << stats.primitives << " primitives, " << stats.nodes << " nodes, "
+              << stats.bytes << " bytes, " << stats.buildMs << " ms";
+}
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -26,47 +52,112 @@ class BVHAccel {
 public:
     // BVHAccel Public Types
     enum class SplitMethod { NAIVE, SAH };
+    // Tree traversed by Intersect: binary LinearBVHNodes, or 4-wide QBVHNodes
+    enum class NodeLayout { Binary, Quad };
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE,
+             NodeLayout layout = NodeLayout::Quad);
+    // BVH over the triangles of mesh, which must outlive it. Leaves hold up to
+    // maxPrimsInNode triangles that are intersected together without virtual calls.
+    BVHAccel(const TriangleMesh* mesh, int maxPrimsInNode = 4, SplitMethod splitMethod = SplitMethod::NAIVE,
+             NodeLayout layout = NodeLayout::Quad);
     Bounds3 WorldBound() const;
     ~BVHAccel();
+    const BVHBuildStats& Stats() const { return stats; }
+    // Rebuild over new primitives, reusing the node memory of the previous build
+    void Rebuild(std::vector<Object*> p);
+    // Recomputes the node bounds after primitives moved, keeping the tree as built. Much
+    // cheaper than Rebuild, though the tree degrades if primitives move far from where
+    // they were. BVHs over Objects only: mesh triangles never move.
+    void Refit();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
-    bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    // Closest hits of the rays of a packet selected by mask. hits[i] is only replaced by a
+    // closer hit, so it also bounds the search.
+    void IntersectPacket(const Ray* rays, Intersection* hits, uint32_t mask) const;
+    // Whether anything is hit closer than tMax. Stops at the first hit found.
+    bool IntersectP(const Ray &ray, float tMax = std::numeric_limits<float>::infinity()) const;
+    BVHBuildNode* root = nullptr;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    void build();
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                 int depth = 0);
+    int flattenBVHTree(BVHBuildNode* node, int* offset);
+    int flattenQBVHTree(BVHBuildNode* node);
+    void intersectQBVH(const Ray& ray, int start, int nPrims, Intersection& isect) const;
+    // Primitives [offset, offset + count) of a leaf
+    void intersectLeaf(int offset, int count, const Ray& ray, Intersection& isect) const;
+    void intersectLeafPacket(int offset, int count, const Ray* rays, Intersection* hits,
+                             uint32_t mask) const;
+    bool intersectLeafP(int offset, int count, const Ray& ray, float tMax) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    const NodeLayout layout;
     std::vector<Object*> primitives;
+    const TriangleMesh* mesh = nullptr;
+    // Depth-first copy of the build tree used for traversal, in the chosen layout, and the
+    // leaf primitives in the same order: objects, or the triangles of mesh
+    std::vector<LinearBVHNode> nodes;
+    std::vector<QBVHNode> qnodes;
+    std::vector<Object*> orderedPrims;
+    LeafTriangles orderedTris;
+    // Build nodes live in the arena, handed out in build order from one contiguous array
+    MemoryArena arena{16 * 1024};
+    BVHBuildNode* buildNodes = nullptr;
+    std::atomic<int> totalNodes{0};
+    BVHBuildStats stats;
+};
 
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
-    void Sample(Intersection &pos, float &pdf);
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3& bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+          centroid(0.5f * bounds.pMin + 0.5f * bounds.pMax) {}
+    size_t primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
 };
 
 struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
-    Object* object;
-    float area;
 
 public:
+    // Leaves cover primitives [firstPrimOffset, firstPrimOffset + nPrimitives) in leaf order
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
     // BVHBuildNode Public Methods
     BVHBuildNode(){
         bounds = Bounds3();
         left = nullptr;right = nullptr;
-        object = nullptr;
     }
 };
 
-
-
+// A node of the flattened tree. The first child of an interior node is stored right after
+// it, so only the offset of the second one is kept.
+struct alignas(32) LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;  // leaf
+        int secondChildOffset; // interior
+    };
+    uint16_t nPrimitives; // 0 for interior nodes
+    uint8_t axis;         // interior node split axis
+    uint8_t pad[1];
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+// A node of the 4-wide tree, collapsed from up to two levels of the binary one. The child
+// boxes are stored SoA so that one SIMD pass tests the ray against all four.
+struct alignas(64) QBVHNode {
+    float bounds[2][3][4]; // [min/max][axis][child]
+    int child[4];          // QBVHNode index, or ~offset of the first primitive of a leaf
+    uint8_t nPrims[4];     // primitives of a leaf child
+    int nChildren;
+};
 
 #endif //RAYTRACING_BVH_H
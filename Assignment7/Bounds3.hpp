@@ -86,6 +86,8 @@ class Bounds3
 
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
                            const std::array<int, 3>& dirisNeg) const;
+    inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
+                           const std::array<int, 3>& dirIsNeg, float tMax) const;
 };
 
 
@@ -115,6 +117,21 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
     return t_enter <= t_exit && t_exit >= 0;
 }
 
+// Same test, but also misses when the box is entered beyond tMax, e.g. the closest hit so far
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
+                                const std::array<int, 3>& dirIsNeg, float tMax) const
+{
+    float tx_min = ((dirIsNeg[0] ? pMax.x : pMin.x) - ray.origin.x) * invDir.x;
+    float tx_max = ((dirIsNeg[0] ? pMin.x : pMax.x) - ray.origin.x) * invDir.x;
+    float ty_min = ((dirIsNeg[1] ? pMax.y : pMin.y) - ray.origin.y) * invDir.y;
+    float ty_max = ((dirIsNeg[1] ? pMin.y : pMax.y) - ray.origin.y) * invDir.y;
+    float tz_min = ((dirIsNeg[2] ? pMax.z : pMin.z) - ray.origin.z) * invDir.z;
+    float tz_max = ((dirIsNeg[2] ? pMin.z : pMax.z) - ray.origin.z) * invDir.z;
+    float t_enter = std::max({ tx_min, ty_min, tz_min });
+    float t_exit = std::min({ tx_max, ty_max, tz_max });
+    return t_enter <= t_exit && t_exit >= 0 && t_enter <= tMax;
+}
+
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
 {
     Bounds3 ret;
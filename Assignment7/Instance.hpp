@@ -0,0 +1,111 @@
+//
+// A mesh placed in the scene with its own transform and material.
+//
+
+#ifndef RAYTRACING_INSTANCE_H
+#define RAYTRACING_INSTANCE_H
+
+#include <cmath>
+#include "Object.hpp"
+#include "Transform.hpp"
+#include "Triangle.hpp"
+
+// Scene object that shares the geometry and BVH of a MeshTriangle (the bottom-level
+// structure) with every other instance of it. Rays are taken into the mesh's space instead
+// of copying its triangles into world space, so a prop repeated a thousand times is loaded
+// and built once. The mesh must outlive its instances.
+class Instance : public Object
+{
+public:
+    // m defaults to the material of the mesh
+    Instance(MeshTriangle* mesh, const Transform& toWorld, Material* m = nullptr)
+        : mesh(mesh), m(m ? m : mesh->m)
+    {
+        setTransform(toWorld);
+    }
+
+    // Moves the instance. The scene BVH only needs a Scene::refitBVH() afterwards.
+    void setTransform(const Transform& t)
+    {
+        toWorld = t;
+        bounding_box = toWorld(mesh->getBounds());
+        // Exact for rotations, translations and uniform scales, which is what getArea and
+        // Sample assume
+        area = mesh->getArea() * std::pow(std::abs(toWorld.Determinant()), 2.f / 3.f);
+    }
+    const Transform& getTransform() const { return toWorld; }
+
+    bool intersect(const Ray& ray) { return true; }
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const { return false; }
+
+    Intersection getIntersection(Ray ray)
+    {
+        Intersection hit = mesh->getIntersection(toWorld.InverseRay(ray));
+        if (hit.happened)
+            toWorldHit(ray, hit);
+        return hit;
+    }
+
+    bool intersectP(const Ray& ray, float tMax)
+    {
+        return mesh->intersectP(toWorld.InverseRay(ray), tMax);
+    }
+
+    void getIntersections(const Ray* rays, Intersection* hits, uint32_t mask)
+    {
+        // Rays of a coherent packet stay coherent in the mesh's space
+        Ray local[kMaxPacketSize];
+        for (int i = 0; i < kMaxPacketSize; ++i) {
+            if (mask & (1u << i))
+                local[i] = toWorld.InverseRay(rays[i]);
+        }
+        Intersection localHits[kMaxPacketSize];
+        mesh->getIntersections(local, localHits, mask);
+        for (int i = 0; i < kMaxPacketSize; ++i) {
+            if ((mask & (1u << i)) && localHits[i].happened && localHits[i].distance < hits[i].distance) {
+                hits[i] = localHits[i];
+                toWorldHit(rays[i], hits[i]);
+            }
+        }
+    }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index,
+                              const Vector2f& uv, Vector3f& N, Vector2f& st) const
+    {}
+    Vector3f evalDiffuseColor(const Vector2f& st) const { return mesh->evalDiffuseColor(st); }
+    Bounds3 getBounds() { return bounding_box; }
+
+    void Sample(Intersection &pos, float &pdf){
+        mesh->Sample(pos, pdf);
+        if (pdf <= 0)
+            return;
+        pos.coords = toWorld.Point(pos.coords);
+        pos.normal = normalize(toWorld.Normal(pos.normal));
+        pos.emit = m->getEmission();
+        pdf = 1.0f / area;
+    }
+    float getArea(){
+        return area;
+    }
+    bool hasEmit(){
+        return m->hasEmission();
+    }
+
+    MeshTriangle* mesh;
+    Transform toWorld;
+    Bounds3 bounding_box;
+    float area;
+    Material* m;
+
+private:
+    // The mesh fills in hits in its own space and names itself as the object hit
+    void toWorldHit(const Ray& ray, Intersection& hit)
+    {
+        hit.coords = ray(hit.distance);
+        hit.normal = normalize(toWorld.Normal(hit.normal));
+        hit.obj = this;
+        hit.m = m;
+    }
+};
+
+#endif // RAYTRACING_INSTANCE_H
@@ -0,0 +1,107 @@
+//
+// Bump allocator for objects that share one lifetime, such as the nodes of a BVH.
+//
+
+#ifndef RAYTRACING_MEMORYARENA_H
+#define RAYTRACING_MEMORYARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <new>
+#include <utility>
+
+// Allocations are carved out of large blocks and released all at once. Reset() keeps the
+// blocks around so that the next round of allocations reuses them. Not thread-safe.
+class MemoryArena
+{
+  public:
+    explicit MemoryArena(size_t blockSize = 256 * 1024) : blockSize(blockSize) {}
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+    ~MemoryArena()
+    {
+        Free(currentBlock);
+        for (auto& block : usedBlocks)
+            Free(block.second);
+        for (auto& block : availableBlocks)
+            Free(block.second);
+    }
+
+    void* Alloc(size_t nBytes)
+    {
+        nBytes = (nBytes + alignment - 1) & ~(alignment - 1);
+        if (currentBlockPos + nBytes > currentAllocSize)
+        {
+            if (currentBlock)
+            {
+                usedBlocks.emplace_back(currentAllocSize, currentBlock);
+                currentBlock = nullptr;
+                currentAllocSize = 0;
+            }
+            for (auto it = availableBlocks.begin(); it != availableBlocks.end(); ++it)
+            {
+                if (it->first >= nBytes)
+                {
+                    currentAllocSize = it->first;
+                    currentBlock = it->second;
+                    availableBlocks.erase(it);
+                    break;
+                }
+            }
+            if (!currentBlock)
+            {
+                currentAllocSize = std::max(nBytes, blockSize);
+                currentBlock = static_cast<uint8_t*>(::operator new(currentAllocSize, std::align_val_t(alignment)));
+            }
+            currentBlockPos = 0;
+        }
+        void* ret = currentBlock + currentBlockPos;
+        currentBlockPos += nBytes;
+        return ret;
+    }
+
+    // n default-constructed objects. Their destructors are never run, so T should not own
+    // resources.
+    template <typename T>
+    T* Alloc(size_t n = 1)
+    {
+        T* ret = static_cast<T*>(Alloc(n * sizeof(T)));
+        for (size_t i = 0; i < n; ++i)
+            new (&ret[i]) T();
+        return ret;
+    }
+
+    void Reset()
+    {
+        currentBlockPos = 0;
+        availableBlocks.splice(availableBlocks.begin(), usedBlocks);
+    }
+
+    size_t TotalAllocated() const
+    {
+        size_t total = currentAllocSize;
+        for (const auto& block : usedBlocks)
+            total += block.first;
+        for (const auto& block : availableBlocks)
+            total += block.first;
+        return total;
+    }
+
+  private:
+    static constexpr size_t alignment = 64;
+
+    static void Free(uint8_t* block)
+    {
+        if (block)
+            ::operator delete(block, std::align_val_t(alignment));
+    }
+
+    const size_t blockSize;
+    size_t currentBlockPos = 0, currentAllocSize = 0;
+    uint8_t* currentBlock = nullptr;
+    std::list<std::pair<size_t, uint8_t*>> usedBlocks, availableBlocks;
+};
+
+#endif // RAYTRACING_MEMORYARENA_H
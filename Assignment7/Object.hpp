@@ -11,6 +11,9 @@
 #include "Ray.hpp"
 #include "Intersection.hpp"
 
+// Largest number of rays traced together as a packet, one bit each in a uint32_t mask
+constexpr int kMaxPacketSize = 16;
+
 class Object
 {
 public:
@@ -19,6 +22,24 @@ public:
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
     virtual Intersection getIntersection(Ray _ray) = 0;
+    // Any hit closer than tMax, without building an Intersection
+    virtual bool intersectP(const Ray& ray, float tMax)
+    {
+        Intersection hit = getIntersection(ray);
+        return hit.happened && hit.distance < tMax;
+    }
+    // Packet version of getIntersection for the rays selected by mask. hits[i] is only
+    // replaced by a closer hit.
+    virtual void getIntersections(const Ray* rays, Intersection* hits, uint32_t mask)
+    {
+        for (int i = 0; i < kMaxPacketSize; ++i) {
+            if (!(mask & (1u << i)))
+                continue;
+            Intersection hit = getIntersection(rays[i]);
+            if (hit.happened && hit.distance < hits[i].distance)
+                hits[i] = hit;
+        }
+    }
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
@@ -12,6 +12,8 @@ struct Ray{
     double t;//transportation time,
     double t_min, t_max;
 
+    // Placeholder for arrays of rays that are filled in later
+    Ray() : Ray(Vector3f(), Vector3f(0, 0, 1)) {}
     Ray(const Vector3f& ori, const Vector3f& dir, const double _t = 0.0): origin(ori), direction(dir),t(_t) {
         direction_inv = Vector3f(1./direction.x, 1./direction.y, 1./direction.z);
         t_min = 0.0;
@@ -2,6 +2,8 @@
 // Created by goksu on 2/25/20.
 //
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <future>
 #include "Scene.hpp"
@@ -10,6 +12,20 @@
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
+// Interleaves the bits of x and y, so that sorting by the result walks a Z-order curve
+inline uint32_t morton2D(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
 const float EPSILON = 0.00001;
 
 // The main render function. This where we iterate over all pixels in the image,
@@ -17,64 +33,194 @@ const float EPSILON = 0.00001;
 // framebuffer is saved to a file.
 void Renderer::Render(const Scene& scene)
 {
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);
+    const int num_pixels = scene.width * scene.height;
+    // Per pixel: sum of the samples, sum of squares of their luminance, and their number.
+    // The image is sum / samples.
+    std::vector<Vector3f> sum(num_pixels);
+    std::vector<float> sum_sq(num_pixels);
+    std::vector<int> samples(num_pixels);
+    // Pixels still being sampled
+    std::vector<uint8_t> active(num_pixels, 1);
 
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(278, 273, -800);
 
-    int num_threads = static_cast<int>(std::thread::hardware_concurrency());
-    std::vector<std::future<void>> futures;
-    std::mutex mutex;
-    std::atomic<int> completed_lines(0);
-
-    // change the spp value to change sample ammount
-    int spp = 16;
-    std::cout << "SPP: " << spp << "\n";
-
-    auto render_task = [&](int start, int end) {
-      for (uint32_t j = start; j < end; ++j) {
-          for (uint32_t i = 0; i < scene.width; ++i) {
-              // generate primary ray direction
-              float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                        imageAspectRatio * scale;
-              float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-              Vector3f dir = normalize(Vector3f(-x, y, 1));
-              uint32_t m = j * scene.width + i;
-              for (int k = 0; k < spp; k++){
-                  framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;
+    int num_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    if (progressive)
+        std::cout << "SPP: up to " << spp << ", error threshold " << errorThreshold << "\n";
+    else
+        std::cout << "SPP: " << spp << "\n";
+    // Samples depend only on the seed, pixel and sample index, so the image does not
+    // change with the number of threads or the order tiles are rendered in
+    Sampler::Type sampler_type = Sampler::Type::Sobol;
+    uint32_t seed = 0;
+
+    // Threads pull small tiles from a shared counter until none are left, so a thread that
+    // drew cheap tiles (e.g. the ceiling) just takes more of them. Tiles are handed out in
+    // Morton order, which keeps the tiles in flight close together on screen and so in
+    // the caches.
+    constexpr int tile = 16;
+    struct Tile { int x0, y0; uint32_t order; };
+    std::vector<Tile> tiles;
+    for (int y0 = 0; y0 < scene.height; y0 += tile) {
+        for (int x0 = 0; x0 < scene.width; x0 += tile)
+            tiles.push_back({x0, y0, morton2D(x0 / tile, y0 / tile)});
+    }
+    std::sort(tiles.begin(), tiles.end(), [](const Tile& a, const Tile& b) { return a.order < b.order; });
+
+    // Camera rays are traced as packets of 4x4 pixel blocks. They do not change between
+    // samples, so each block is traced once per pass and its hits are shaded as many times
+    // as the pass asks for.
+    constexpr int block = 4;
+    static_assert(block * block <= kMaxPacketSize, "a pixel block must fit in one packet");
+    static_assert(tile % block == 0, "a tile must be made of whole pixel blocks");
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (progressive && timeBudget > 0)
+        deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double>(timeBudget));
+
+    // Adds pass_spp samples to every active pixel. Returns once all tiles are done, or
+    // early past pass_deadline, leaving the remaining tiles of the pass unsampled.
+    auto render_pass = [&](int pass_spp, std::chrono::steady_clock::time_point pass_deadline) {
+        std::atomic<int> next_tile(0);
+        // Only counted by the workers; the main thread reads it to draw the progress bar
+        std::atomic<int> completed_tiles(0);
+
+        auto render_task = [&]() {
+          Sampler& sampler = ThreadSampler();
+          sampler = Sampler(sampler_type, spp, seed);
+          std::vector<Ray> rays;
+          std::vector<uint32_t> pixels;
+          rays.reserve(block * block);
+          pixels.reserve(block * block);
+          for (int t = next_tile.fetch_add(1, std::memory_order_relaxed); t < (int)tiles.size();
+               t = next_tile.fetch_add(1, std::memory_order_relaxed)) {
+              if (std::chrono::steady_clock::now() > pass_deadline)
+                  break;
+              int x_end = std::min(tiles[t].x0 + tile, scene.width);
+              int y_end = std::min(tiles[t].y0 + tile, scene.height);
+              for (int j0 = tiles[t].y0; j0 < y_end; j0 += block) {
+                  int j1 = std::min(j0 + block, y_end);
+                  for (int i0 = tiles[t].x0; i0 < x_end; i0 += block) {
+                      int i1 = std::min(i0 + block, x_end);
+                      rays.clear();
+                      pixels.clear();
+                      for (uint32_t j = j0; j < j1; ++j) {
+                          for (uint32_t i = i0; i < i1; ++i) {
+                              if (!active[j * scene.width + i])
+                                  continue;
+                              // generate primary ray direction
+                              float x = (2 * (i + 0.5) / (float)scene.width - 1) *
+                                        imageAspectRatio * scale;
+                              float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+
+                              Vector3f dir = normalize(Vector3f(-x, y, 1));
+                              rays.emplace_back(eye_pos, dir);
+                              pixels.push_back(j * scene.width + i);
+                          }
+                      }
+                      if (rays.empty())
+                          continue;
+
+                      Intersection hits[kMaxPacketSize];
+                      scene.intersect(rays.data(), hits, (int)rays.size());
+                      for (size_t q = 0; q < rays.size(); ++q) {
+                          uint32_t pixel = pixels[q];
+                          for (int k = 0; k < pass_spp; k++){
+                              sampler.StartPixelSample(pixel, samples[pixel] + k);
+                              Vector3f radiance = scene.shade(rays[q], hits[q], 0);
+                              float luminance = (radiance.x + radiance.y + radiance.z) / 3;
+                              sum[pixel] += radiance;
+                              sum_sq[pixel] += luminance * luminance;
+                          }
+                          samples[pixel] += pass_spp;
+                      }
+                  }
               }
+              completed_tiles.fetch_add(1, std::memory_order_relaxed);
           }
-          {
-              std::lock_guard<std::mutex> lock(mutex);
-              ++completed_lines;
-              UpdateProgress((float)completed_lines / (float)scene.height);
-          }
-      }
+        };
+
+        std::vector<std::future<void>> futures;
+        for (int i = 0; i < num_threads; ++i)
+        {
+            futures.emplace_back(std::async(std::launch::async, render_task));
+        }
+        for (auto& future : futures)
+        {
+            while (future.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+            {
+                UpdateProgress(completed_tiles.load(std::memory_order_relaxed) / (float)tiles.size());
+            }
+            future.get();
+        }
+        UpdateProgress(1.f);
     };
 
-    for (int i = 0; i < num_threads; ++i)
-    {
-        int start = i * scene.height / num_threads;
-        int end = std::min((i + 1) * scene.height / num_threads, scene.height);
-        futures.emplace_back(std::async(std::launch::async, render_task, start, end));
-    }
-    for (auto& future : futures)
-    {
-        future.get();
+    if (!progressive) {
+        render_pass(spp, deadline);
     }
+    else {
+        // Every pixel first gets enough samples for a usable variance estimate, and at least
+        // one whatever the budgets, so the first pass is never cut short. After each pass,
+        // pixels whose estimated error is below the threshold stop, and the next pass spends
+        // the budget on the rest only.
+        int64_t used = 0;
+        int num_active = num_pixels;
+        for (int pass = 0; num_active > 0 && std::chrono::steady_clock::now() < deadline; ++pass) {
+            int pass_spp = pass == 0 ? std::min(minSamples, spp) : std::min(passSamples, spp);
+            if (sampleBudget > 0)
+                pass_spp = (int)std::min<int64_t>(pass_spp, (sampleBudget - used) / num_active);
+            if (pass == 0)
+                pass_spp = std::max(pass_spp, 1);
+            if (pass_spp <= 0)
+                break;
+            render_pass(pass_spp, pass == 0 ? std::chrono::steady_clock::time_point::max() : deadline);
 
-    UpdateProgress(1.f);
+            num_active = 0;
+            used = 0;
+            for (int i = 0; i < num_pixels; ++i) {
+                used += samples[i];
+                if (!active[i])
+                    continue;
+                // Standard error of the mean luminance, carried through the gamma curve of
+                // the output below, so errors are judged as they show up in the image.
+                // Pixels that will be clamped to white no matter what are done.
+                int n = samples[i];
+                if (n == 0) {
+                    // No samples yet, so nothing to estimate the error from
+                    ++num_active;
+                    continue;
+                }
+                float mean = (sum[i].x + sum[i].y + sum[i].z) / (3 * n);
+                float variance = std::max(0.f, (sum_sq[i] - n * mean * mean) / (n - 1));
+                float std_error = std::sqrt(variance / n);
+                float error = mean - 2 * std_error > 1.f ?
+                              0.f : 0.6f * std::pow(std::max(mean, 0.01f), -0.4f) * std_error;
+                if (n >= spp || (n > 1 && error < errorThreshold))
+                    active[i] = 0;
+                else
+                    ++num_active;
+            }
+            std::cout << "\nPass " << pass << ": " << used << " samples, " << num_active
+                      << " pixels still sampling\n";
+        }
+        std::cout << "Average SPP: " << (double)used / num_pixels << "\n";
+    }
 
     // save framebuffer to file
     FILE* fp = fopen("binary.ppm", "wb");
     (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
     for (auto i = 0; i < scene.height * scene.width; ++i) {
         static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
+        Vector3f pixel = samples[i] > 0 ? sum[i] / samples[i] : Vector3f(0);
+        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, pixel.x), 0.6f));
+        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, pixel.y), 0.6f));
+        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, pixel.z), 0.6f));
         fwrite(color, 1, 3, fp);
     }
     fclose(fp);    
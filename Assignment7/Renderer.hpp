@@ -17,5 +17,24 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    // Samples per pixel, or the most any pixel gets in progressive mode
+    int spp = 16;
+    // Progressive mode renders in passes and stops sampling a pixel once the standard error
+    // of its mean luminance, as it shows in the 8-bit output, is below errorThreshold. The
+    // error is absolute and on a [0, 1] display scale: it is scaled by the slope of the
+    // output gamma curve, 0.6 * mean^-0.4, so dark pixels need a smaller error than bright
+    // ones. 1/255 is about one output level. Pixels that clamp to white are done at once.
+    bool progressive = false;
+    float errorThreshold = 0.02f;
+    // Samples of the first pass, which every pixel gets, and of each later pass
+    int minSamples = 16;
+    int passSamples = 16;
+    // Limits on the whole progressive render; 0 for none. Either one turns on progressive
+    // mode. The first pass always runs to the end, so every pixel gets at least one sample;
+    // past the time budget a later pass is cut short, which only leaves some pixels with
+    // fewer samples.
+    int64_t sampleBudget = 0;
+    double timeBudget = 0; // seconds
+
 private:
 };
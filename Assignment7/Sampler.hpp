@@ -0,0 +1,235 @@
+//
+// Random and low-discrepancy sample generation for the path tracer.
+//
+
+#ifndef RAYTRACING_SAMPLER_H
+#define RAYTRACING_SAMPLER_H
+
+#include <cstdint>
+#include "Vector.hpp"
+
+// PCG32 (pcg-random.org): 64 bits of state, independent streams, and jumping ahead in
+// O(log n)
+class PCG32
+{
+public:
+    PCG32() { SetSequence(0xda3e39cb94b95bdbULL, 0x853c49e6748fea9bULL); }
+    PCG32(uint64_t sequenceIndex, uint64_t seed) { SetSequence(sequenceIndex, seed); }
+
+    void SetSequence(uint64_t sequenceIndex, uint64_t seed)
+    {
+        state = 0u;
+        inc = (sequenceIndex << 1u) | 1u;
+        Uniform();
+        state += seed;
+        Uniform();
+    }
+
+    uint32_t Uniform()
+    {
+        uint64_t oldstate = state;
+        state = oldstate * mult + inc;
+        uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+        uint32_t rot = (uint32_t)(oldstate >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+
+    // In [0, 1)
+    float UniformFloat() { return (Uniform() >> 8) * 0x1p-24f; }
+
+    // Skips the next delta values
+    void Advance(uint64_t delta)
+    {
+        uint64_t curMult = mult, curPlus = inc, accMult = 1u, accPlus = 0u;
+        while (delta > 0) {
+            if (delta & 1) {
+                accMult *= curMult;
+                accPlus = accPlus * curMult + curPlus;
+            }
+            curPlus = (curMult + 1) * curPlus;
+            curMult *= curMult;
+            delta /= 2;
+        }
+        state = accMult * state + accPlus;
+    }
+
+private:
+    static constexpr uint64_t mult = 0x5851f42d4c957f2dULL;
+    uint64_t state, inc;
+};
+
+// Hands out the sample values of one pixel sample at a time, one dimension per value.
+// Values depend only on the seed, the pixel, the sample index and the dimension, never on
+// which thread asks or in what order pixels are rendered, so renders are reproducible.
+//  - Independent: uniform random values
+//  - Stratified: each dimension is split into samplesPerPixel strata, and every sample
+//    of a pixel falls in a different one (a Latin hypercube)
+//  - Sobol: Owen-scrambled 2D Sobol points, shuffled independently for each pair of
+//    dimensions (Burley, "Practical Hash-based Owen Scrambling", 2020)
+class Sampler
+{
+public:
+    enum class Type { Independent, Stratified, Sobol };
+
+    Sampler(Type type = Type::Independent, int samplesPerPixel = 1, uint32_t seed = 0)
+        : type(type), samplesPerPixel(samplesPerPixel), seed(seed)
+    {
+        StartPixelSample(0, 0);
+    }
+
+    int SamplesPerPixel() const { return samplesPerPixel; }
+
+    void StartPixelSample(uint32_t pixel, int sampleIndex)
+    {
+        this->pixel = pixel;
+        this->sampleIndex = (uint32_t)sampleIndex;
+        dimension = 0;
+        // Each pixel gets its own stream, and each sample its own stretch of it
+        rng.SetSequence(hash(pixel, seed), 0);
+        rng.Advance((uint64_t)sampleIndex << 16);
+    }
+
+    float Get1D()
+    {
+        uint32_t d = dimension++;
+        switch (type) {
+        case Type::Stratified:
+            return stratum(d);
+        case Type::Sobol:
+            return sobol(d, false).x;
+        default:
+            return rng.UniformFloat();
+        }
+    }
+
+    Vector2f Get2D()
+    {
+        uint32_t d = dimension;
+        dimension += 2;
+        switch (type) {
+        case Type::Stratified:
+            return Vector2f(stratum(d), stratum(d + 1));
+        case Type::Sobol:
+            return sobol(d, true);
+        default: {
+            float u = rng.UniformFloat();
+            return Vector2f(u, rng.UniformFloat());
+        }
+        }
+    }
+
+private:
+    static float toFloat(uint32_t bits) { return (bits >> 8) * 0x1p-24f; }
+
+    static uint32_t hash(uint64_t a, uint64_t b, uint64_t c = 0)
+    {
+        // MurmurHash3 finalizer over the combined inputs
+        uint64_t h = a * 0x9e3779b97f4a7c15ULL ^ (b + 0x632be59bd9b4e019ULL) * 0xbf58476d1ce4e5b9ULL ^
+                     (c + 0x8cb92ba72f3d8dd7ULL) * 0x94d049bb133111ebULL;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return (uint32_t)h;
+    }
+
+    uint32_t dimensionSeed(uint32_t d) const { return hash(pixel, d, seed); }
+
+    // Latin hypercube: a per-pixel, per-dimension permutation picks the stratum of each
+    // sample, and the offset inside the stratum is random
+    float stratum(uint32_t d)
+    {
+        uint32_t s = permutationElement(sampleIndex % samplesPerPixel, samplesPerPixel, dimensionSeed(d));
+        float u = (s + rng.UniformFloat()) / samplesPerPixel;
+        return u < 1.f ? u : 0x1.fffffep-1f;
+    }
+
+    // Element i of a random permutation of [0, n) chosen by p (Kensler, "Correlated
+    // Multi-Jittered Sampling", 2013)
+    static uint32_t permutationElement(uint32_t i, uint32_t n, uint32_t p)
+    {
+        uint32_t w = n - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do {
+            i ^= p;
+            i *= 0xe170893d;
+            i ^= p >> 16;
+            i ^= (i & w) >> 4;
+            i ^= p >> 8;
+            i *= 0x0929eb3f;
+            i ^= p >> 23;
+            i ^= (i & w) >> 1;
+            i *= 1 | p >> 27;
+            i *= 0x6935fa69;
+            i ^= (i & w) >> 11;
+            i *= 0x74dcb303;
+            i ^= (i & w) >> 2;
+            i *= 0x9e501cc3;
+            i ^= (i & w) >> 2;
+            i *= 0xc860a3df;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= n);
+        return (i + p) % n;
+    }
+
+    static uint32_t reverseBits(uint32_t v)
+    {
+        v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+        v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+        v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+        v = ((v >> 8) & 0x00ff00ff) | ((v & 0x00ff00ff) << 8);
+        return (v >> 16) | (v << 16);
+    }
+
+    // Owen scrambling of the bits of x read as a binary fraction
+    static uint32_t owenScramble(uint32_t x, uint32_t seed)
+    {
+        x = reverseBits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverseBits(x);
+    }
+
+    // Shuffled and scrambled 2D Sobol point for dimensions d, d + 1. Single dimensions only
+    // need the first coordinate, which is a scrambled van der Corput sequence.
+    Vector2f sobol(uint32_t d, bool both) const
+    {
+        uint32_t pairSeed = dimensionSeed(d);
+        uint32_t index = owenScramble(sampleIndex, pairSeed);
+        Vector2f u(toFloat(owenScramble(reverseBits(index), hash(pairSeed, 1))), 0.f);
+        if (both) {
+            uint32_t y = 0;
+            for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+                if (index & 1)
+                    y ^= v;
+            }
+            u.y = toFloat(owenScramble(y, hash(pairSeed, 2)));
+        }
+        return u;
+    }
+
+    Type type;
+    uint32_t samplesPerPixel;
+    uint32_t seed;
+    uint32_t pixel = 0, sampleIndex = 0, dimension = 0;
+    PCG32 rng;
+};
+
+// The sampler that get_random_float() draws from on the calling thread. Renderer
+// replaces it on its worker threads and starts a pixel sample before tracing each path.
+inline Sampler& ThreadSampler()
+{
+    thread_local Sampler sampler;
+    return sampler;
+}
+
+#endif // RAYTRACING_SAMPLER_H
@@ -2,12 +2,45 @@
 // Created by Göksu Güvendiren on 2019-05-14.
 //
 
+#include <cassert>
 #include "Scene.hpp"
 
 
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    if (this->bvh)
+        this->bvh->Rebuild(objects);
+    else
+        this->bvh = std::make_unique<BVHAccel>(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    buildLightDistribution();
+}
+
+void Scene::buildLightDistribution()
+{
+    emitters.clear();
+    std::vector<float> areas;
+    emitAreaSum = 0;
+    for (Object* object : objects) {
+        // Emitters without area could never be sampled
+        if (object->hasEmit() && object->getArea() > 0) {
+            emitters.push_back(object);
+            areas.push_back(object->getArea());
+            emitAreaSum += areas.back();
+        }
+    }
+    emitterTable = AliasTable(areas);
+}
+
+void Scene::refitBVH()
+{
+    if (!this->bvh)
+    {
+        buildBVH();
+        return;
+    }
+    this->bvh->Refit();
+    // Scaled instances change area
+    buildLightDistribution();
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -15,25 +48,35 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
+bool Scene::occluded(const Ray &ray, float tMax) const
+{
+    return this->bvh->IntersectP(ray, tMax);
+}
+
+void Scene::intersect(const Ray* rays, Intersection* hits, int n) const
+{
+    assert(n <= kMaxPacketSize);
+    this->bvh->IntersectPacket(rays, hits, (1u << n) - 1);
+}
+
 void Scene::sampleLight(Intersection &pos, float &pdf) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
+    if (emitterTable.size() == 0)
+    {
+        pdf = 0;
+        return;
     }
+    float pmf;
+    int k = emitterTable.Sample(get_random_float(), &pmf);
+    emitters[k]->Sample(pos, pdf);
+    // The object itself was picked with probability area / total area
+    pdf *= pmf;
+}
+
+float Scene::pdfLight(const Intersection & /*light*/) const
+{
+    // Emitters are picked by area and sampled uniformly, so every point is equally likely
+    return emitAreaSum > 0 ? 1.0f / emitAreaSum : 0.0f;
 }
 
 bool Scene::trace(
@@ -57,11 +100,22 @@ bool Scene::trace(
     return (*hitObject != nullptr);
 }
 
+// Multiple importance sampling weight of a sample drawn with density f, when another
+// strategy would have drawn it with density g
+inline float powerHeuristic(float f, float g)
+{
+    return f * f / (f * f + g * g);
+}
+
 // Implementation of Path Tracing
 Vector3f Scene::castRay(const Ray &ray, int depth) const
+{
+    return shade(ray, intersect(ray), depth);
+}
+
+Vector3f Scene::shade(const Ray &ray, const Intersection &inter_shading_point, int depth) const
 {
     // Implement Path Tracing Algorithm
-    Intersection inter_shading_point = intersect(ray);
     if (!inter_shading_point.happened || !inter_shading_point.m)
     {
         return {0};
@@ -82,6 +136,10 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
         Intersection inter_light;
         float pdf_light = 0.0f;
         sampleLight(inter_light, pdf_light);
+        if (pdf_light <= 0.0f)
+        {
+            break;
+        }
         const Vector3f& x = inter_light.coords;
         Vector3f ws = x - p;
         float ws_sqr = dotProduct(ws, ws);
@@ -93,17 +151,23 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
         float dist_light = sqrt(ws_sqr);
         ws = ws / dist_light;
         Ray r(p_deviation, ws);
-        Intersection inter_blocked_point = intersect(r);
-        if (inter_blocked_point.distance < dist_light - 0.1f)
+        if (occluded(r, dist_light - 0.1f))
         {
             break;
         }
 
         float cos_shading_point = dotProduct(N, ws);
         float cos_light = dotProduct(inter_light.normal, -ws);
+        if (cos_light <= 0.0f)
+        {
+            break;
+        }
+        // Solid angle density of the light sample, weighed against the BSDF sampling below,
+        // which may pick the same direction
+        float pdf_light_dir = pdf_light * ws_sqr / cos_light;
+        float weight = powerHeuristic(pdf_light_dir, inter_shading_point.m->pdf(wo, ws, N));
         l_dir = inter_light.emit * inter_shading_point.m->eval(wo, ws, N)
-                * cos_shading_point * cos_light
-                / (ws_sqr * pdf_light);
+                * cos_shading_point * weight / pdf_light_dir;
     } while (false);
 
     do
@@ -125,17 +189,37 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
         wi = wi * wi_len_inv;
         Ray r(p_deviation, wi);
         Intersection inter_bounce = intersect(r);
-        if (inter_bounce.happened && inter_bounce.obj && !inter_bounce.obj->hasEmit())
+        if (!inter_bounce.happened || !inter_bounce.obj)
+        {
+            break;
+        }
+        float pdf = inter_shading_point.m->pdf(wo, wi, N);
+        if (pdf <= EPSILON)
         {
-            float pdf = inter_shading_point.m->pdf(wo, wi, N);
-            if (pdf > EPSILON)
+            break;
+        }
+        float cos_shading_point = dotProduct(N, wi);
+        Vector3f throughput = inter_shading_point.m->eval(wo, wi, N) * cos_shading_point
+                              / (pdf * RussianRoulette);
+        if (inter_bounce.obj->hasEmit())
+        {
+            // Light that the light sampling above may also have found, so it only gets the
+            // BSDF sampling share of the weight
+            float cos_light = dotProduct(inter_bounce.normal, -wi);
+            if (cos_light > 0.0f)
             {
-                float cos_shading_point = dotProduct(N, wi);
-                l_indir = castRay(r, depth + 1) * inter_shading_point.m->eval(wo, wi, N)
-                          * cos_shading_point / (pdf * RussianRoulette);
+                float pdf_light_dir = pdfLight(inter_bounce) * inter_bounce.distance * inter_bounce.distance
+                                      / cos_light;
+                l_indir = inter_bounce.m->getEmission() * throughput * powerHeuristic(pdf, pdf_light_dir);
             }
         }
+        else
+        {
+            l_indir = shade(r, inter_bounce, depth + 1) * throughput;
+        }
     } while (false);
 
-    return inter_shading_point.m->getEmission() + l_dir + l_indir;
+    // Emitters only shine from their front side, as for the light samples above
+    Vector3f emission = dotProduct(N, -ray.direction) > 0.0f ? inter_shading_point.m->getEmission() : Vector3f(0.0f);
+    return emission + l_dir + l_indir;
 }
\ No newline at end of file
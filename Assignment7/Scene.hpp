@@ -9,6 +9,7 @@
 #include "Object.hpp"
 #include "Light.hpp"
 #include "AreaLight.hpp"
+#include "AliasTable.hpp"
 #include "BVH.hpp"
 #include "Ray.hpp"
 
@@ -33,10 +34,21 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
-    BVHAccel *bvh;
+    // Shadow ray query: whether anything blocks ray before tMax
+    bool occluded(const Ray& ray, float tMax) const;
+    // Closest hits of a packet of up to kMaxPacketSize rays, e.g. camera rays of a pixel block
+    void intersect(const Ray* rays, Intersection* hits, int n) const;
+    std::unique_ptr<BVHAccel> bvh;
+    // Also rebuilds the light distribution, so call it again after adding objects
     void buildBVH();
+    // Cheap update of the scene BVH after objects (e.g. instances) moved but none were added
+    void refitBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
+    // Radiance along ray given its closest hit, so hits traced elsewhere (packets) can be shaded
+    Vector3f shade(const Ray &ray, const Intersection &hit, int depth) const;
     void sampleLight(Intersection &pos, float &pdf) const;
+    // Area density with which sampleLight picks a point on the emitter that was hit
+    float pdfLight(const Intersection &light) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -47,6 +59,12 @@ public:
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
 
+    // Emissive objects, picked by sampleLight with probability proportional to their area
+    void buildLightDistribution();
+    std::vector<Object*> emitters;
+    AliasTable emitterTable;
+    float emitAreaSum = 0;
+
     // Compute reflection direction
     Vector3f reflect(const Vector3f &I, const Vector3f &N) const
     {
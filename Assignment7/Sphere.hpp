@@ -78,7 +78,8 @@ public:
                        Vector3f(center.x+radius, center.y+radius, center.z+radius));
     }
     void Sample(Intersection &pos, float &pdf){
-        float theta = 2.0 * M_PI * get_random_float(), phi = M_PI * get_random_float();
+        Vector2f u = get_random_float2();
+        float theta = 2.0 * M_PI * u.x, phi = M_PI * u.y;
         Vector3f dir(std::cos(phi), std::sin(phi)*std::cos(theta), std::sin(phi)*std::sin(theta));
         pos.coords = center + radius * dir;
         pos.normal = dir;
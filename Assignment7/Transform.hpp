@@ -0,0 +1,123 @@
+//
+// Affine transforms for placing instances in the scene.
+//
+
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include <cmath>
+#include "Bounds3.hpp"
+#include "Ray.hpp"
+#include "Vector.hpp"
+#include "global.hpp"
+
+// A 3x4 affine matrix [A | t] kept together with its inverse
+class Transform
+{
+public:
+    Transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}, mInv{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+    explicit Transform(const float mat[3][4])
+    {
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                m[i][j] = mat[i][j];
+        invert();
+    }
+
+    static Transform Translate(const Vector3f& delta)
+    {
+        const float mat[3][4] = {{1, 0, 0, delta.x}, {0, 1, 0, delta.y}, {0, 0, 1, delta.z}};
+        return Transform(mat);
+    }
+    static Transform Scale(const Vector3f& s)
+    {
+        const float mat[3][4] = {{s.x, 0, 0, 0}, {0, s.y, 0, 0}, {0, 0, s.z, 0}};
+        return Transform(mat);
+    }
+    // Counter-clockwise rotation by theta degrees around axis, through the origin
+    static Transform Rotate(float theta, const Vector3f& axis)
+    {
+        Vector3f a = normalize(axis);
+        float rad = theta * M_PI / 180.f;
+        float s = std::sin(rad), c = std::cos(rad);
+        const float mat[3][4] = {
+            {a.x * a.x + (1 - a.x * a.x) * c, a.x * a.y * (1 - c) - a.z * s, a.x * a.z * (1 - c) + a.y * s, 0},
+            {a.x * a.y * (1 - c) + a.z * s, a.y * a.y + (1 - a.y * a.y) * c, a.y * a.z * (1 - c) - a.x * s, 0},
+            {a.x * a.z * (1 - c) - a.y * s, a.y * a.z * (1 - c) + a.x * s, a.z * a.z + (1 - a.z * a.z) * c, 0}};
+        return Transform(mat);
+    }
+
+    // Applies t2 first, then *this
+    Transform operator*(const Transform& t2) const
+    {
+        float mat[3][4];
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                mat[i][j] = m[i][0] * t2.m[0][j] + m[i][1] * t2.m[1][j] + m[i][2] * t2.m[2][j];
+            }
+            mat[i][3] += m[i][3];
+        }
+        return Transform(mat);
+    }
+
+    Vector3f Point(const Vector3f& p) const { return apply(m, p) + Vector3f(m[0][3], m[1][3], m[2][3]); }
+    Vector3f Vector(const Vector3f& v) const { return apply(m, v); }
+    // Normals go through the inverse transpose, which keeps them perpendicular to the surface
+    Vector3f Normal(const Vector3f& n) const
+    {
+        return Vector3f(mInv[0][0] * n.x + mInv[1][0] * n.y + mInv[2][0] * n.z,
+                        mInv[0][1] * n.x + mInv[1][1] * n.y + mInv[2][1] * n.z,
+                        mInv[0][2] * n.x + mInv[1][2] * n.y + mInv[2][2] * n.z);
+    }
+    // ray in the space this transform maps from. The direction is not renormalized, so hit
+    // distances along the result are distances along ray.
+    Ray InverseRay(const Ray& ray) const
+    {
+        return Ray(apply(mInv, ray.origin) + Vector3f(mInv[0][3], mInv[1][3], mInv[2][3]),
+                   apply(mInv, ray.direction));
+    }
+    // Box around the transformed corners of b
+    Bounds3 operator()(const Bounds3& b) const
+    {
+        Bounds3 ret;
+        for (int corner = 0; corner < 8; ++corner) {
+            Vector3f p((corner & 1) ? b.pMax.x : b.pMin.x, (corner & 2) ? b.pMax.y : b.pMin.y,
+                       (corner & 4) ? b.pMax.z : b.pMin.z);
+            ret = Union(ret, Point(p));
+        }
+        return ret;
+    }
+    // Determinant of the linear part: the volume scale, negative if the transform mirrors
+    float Determinant() const
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+private:
+    static Vector3f apply(const float mat[3][4], const Vector3f& v)
+    {
+        return Vector3f(mat[0][0] * v.x + mat[0][1] * v.y + mat[0][2] * v.z,
+                        mat[1][0] * v.x + mat[1][1] * v.y + mat[1][2] * v.z,
+                        mat[2][0] * v.x + mat[2][1] * v.y + mat[2][2] * v.z);
+    }
+
+    void invert()
+    {
+        float detInv = 1.f / Determinant();
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                // Cofactor of m[j][i], which is the adjugate entry (i, j)
+                int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+                mInv[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) * detInv;
+            }
+        }
+        for (int i = 0; i < 3; ++i)
+            mInv[i][3] = -(mInv[i][0] * m[0][3] + mInv[i][1] * m[1][3] + mInv[i][2] * m[2][3]);
+    }
+
+    float m[3][4], mInv[3][4];
+};
+
+#endif // RAYTRACING_TRANSFORM_H
@@ -1,13 +1,16 @@
 #pragma once
 
+#include "AliasTable.hpp"
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
 #include "OBJ_Loader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
+#include <algorithm>
 #include <cassert>
 #include <array>
+#include <map>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
@@ -62,6 +65,7 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    bool intersectP(const Ray& ray, float tMax) override;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -73,7 +77,8 @@ public:
     Vector3f evalDiffuseColor(const Vector2f&) const override;
     Bounds3 getBounds() override;
     void Sample(Intersection &pos, float &pdf){
-        float x = std::sqrt(get_random_float()), y = get_random_float();
+        Vector2f u = get_random_float2();
+        float x = std::sqrt(u.x), y = u.y;
         pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
         pos.normal = this->normal;
         pdf = 1.0f / area;
@@ -96,43 +101,33 @@ public:
         area = 0;
         m = mt;
         assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
-
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
-
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+        auto& loaded = loader.LoadedMeshes[0];
+
+        mesh.owner = this;
+        mesh.m = mt;
+        // The loader repeats shared vertices for every face that uses them
+        std::map<std::array<float, 3>, uint32_t> vertexIds;
+        for (const auto& v : loaded.Vertices) {
+            std::array<float, 3> key = {v.Position.X, v.Position.Y, v.Position.Z};
+            auto it = vertexIds.find(key);
+            if (it == vertexIds.end())
+                it = vertexIds.emplace(key, mesh.addVertex(Vector3f(key[0], key[1], key[2]))).first;
+            mesh.indices.push_back(it->second);
         }
-
-        bounding_box = Bounds3(min_vert, max_vert);
-
-        std::vector<Object*> ptrs;
-        for (auto& tri : triangles){
-            ptrs.push_back(&tri);
-            area += tri.area;
+        mesh.indices.resize(mesh.indices.size() / 3 * 3);
+
+        bounding_box = Bounds3();
+        std::vector<float> areas(mesh.triangleCount());
+        for (size_t t = 0; t < mesh.triangleCount(); ++t) {
+            Vector3f v0, v1, v2;
+            mesh.triangle(t, v0, v1, v2);
+            bounding_box = Union(bounding_box, mesh.bounds(t));
+            areas[t] = crossProduct(v1 - v0, v2 - v0).norm() * 0.5f;
+            area += areas[t];
         }
-        bvh = new BVHAccel(ptrs);
+        triangleTable = AliasTable(areas);
+
+        bvh = std::make_unique<BVHAccel>(&mesh);
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -184,6 +179,11 @@ public:
                     Vector3f(0.937, 0.937, 0.231), pattern);
     }
 
+    bool intersectP(const Ray& ray, float tMax)
+    {
+        return bvh && bvh->IntersectP(ray, tMax);
+    }
+
     Intersection getIntersection(Ray ray)
     {
         Intersection intersec;
@@ -194,10 +194,31 @@ public:
 
         return intersec;
     }
-    
+
+    void getIntersections(const Ray* rays, Intersection* hits, uint32_t mask)
+    {
+        if (bvh)
+            bvh->IntersectPacket(rays, hits, mask);
+    }
+
+    // Picks a triangle with probability proportional to its area, then a uniform point on it.
+    // The value that picked the triangle is rescaled to [0, 1) and reused for the point, so
+    // the two values of one 2D sample stratify the whole mesh.
     void Sample(Intersection &pos, float &pdf){
-        bvh->Sample(pos, pdf);
+        Vector2f u = get_random_float2();
+        if (triangleTable.size() == 0) {
+            // No triangle has any area, so there is no point to pick
+            pdf = 0;
+            return;
+        }
+        int t = triangleTable.Sample(u.x, nullptr, &u.x);
+        Vector3f v0, v1, v2;
+        mesh.triangle(t, v0, v1, v2);
+        float x = std::sqrt(u.x), y = u.y;
+        pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
+        pos.normal = normalize(crossProduct(v1 - v0, v2 - v0));
         pos.emit = m->getEmission();
+        pdf = 1.0f / area;
     }
     float getArea(){
         return area;
@@ -212,9 +233,11 @@ public:
     std::unique_ptr<uint32_t[]> vertexIndex;
     std::unique_ptr<Vector2f[]> stCoordinates;
 
-    std::vector<Triangle> triangles;
+    TriangleMesh mesh;
+    // Triangles by area, used to pick a triangle when sampling
+    AliasTable triangleTable;
 
-    BVHAccel* bvh;
+    std::unique_ptr<BVHAccel> bvh;
     float area;
 
     Material* m;
@@ -251,6 +274,8 @@ inline Intersection Triangle::getIntersection(Ray ray)
     if (v < 0 || u + v > 1)
         return inter;
     t_tmp = dotProduct(e2, qvec) * det_inv;
+    if (t_tmp < 0)
+        return inter;
 
     // find ray triangle intersection
     inter.happened = true;
@@ -263,6 +288,29 @@ inline Intersection Triangle::getIntersection(Ray ray)
     return inter;
 }
 
+// Same test as getIntersection, for hits in [0, tMax)
+inline bool Triangle::intersectP(const Ray& ray, float tMax)
+{
+    if (dotProduct(ray.direction, normal) > 0)
+        return false;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    double det = dotProduct(e1, pvec);
+    if (fabs(det) < EPSILON)
+        return false;
+
+    double det_inv = 1. / det;
+    Vector3f tvec = ray.origin - v0;
+    double u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    double v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    double t = dotProduct(e2, qvec) * det_inv;
+    return t >= 0 && t < tMax;
+}
+
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 {
     return Vector3f(0.5, 0.5, 0.5);
@@ -0,0 +1,52 @@
+//
+// Indexed triangle geometry shared by the triangles of a mesh.
+//
+
+#ifndef RAYTRACING_TRIANGLEMESH_H
+#define RAYTRACING_TRIANGLEMESH_H
+
+#include <cstdint>
+#include <vector>
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+class Object;
+class Material;
+
+// Vertex positions in SoA layout, shared between triangles, and three indices per triangle
+struct TriangleMesh
+{
+    std::vector<float> x, y, z;
+    std::vector<uint32_t> indices;
+    // Reported by every hit on the mesh
+    Object* owner = nullptr;
+    Material* m = nullptr;
+
+    size_t triangleCount() const { return indices.size() / 3; }
+
+    uint32_t addVertex(const Vector3f& p)
+    {
+        x.push_back(p.x);
+        y.push_back(p.y);
+        z.push_back(p.z);
+        return (uint32_t)(x.size() - 1);
+    }
+
+    Vector3f vertex(uint32_t i) const { return Vector3f(x[i], y[i], z[i]); }
+
+    void triangle(size_t t, Vector3f& v0, Vector3f& v1, Vector3f& v2) const
+    {
+        v0 = vertex(indices[3 * t]);
+        v1 = vertex(indices[3 * t + 1]);
+        v2 = vertex(indices[3 * t + 2]);
+    }
+
+    Bounds3 bounds(size_t t) const
+    {
+        Vector3f v0, v1, v2;
+        triangle(t, v0, v1, v2);
+        return Union(Bounds3(v0, v1), v2);
+    }
+};
+
+#endif // RAYTRACING_TRIANGLEMESH_H
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cmath>
 #include <random>
+#include "Sampler.hpp"
 
 #undef M_PI
 #define M_PI 3.141592653589793f
@@ -28,13 +29,16 @@ inline  bool solveQuadratic(const float &a, const float &b, const float &c, floa
     return true;
 }
 
+// Next value in [0, 1) of the current pixel sample on this thread
 inline float get_random_float()
 {
-    static std::random_device dev;
-    static std::mt19937 rng(dev());
-    static std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
+    return ThreadSampler().Get1D();
+}
 
-    return dist(rng);
+// Next two values of the current pixel sample, stratified together when the sampler can
+inline Vector2f get_random_float2()
+{
+    return ThreadSampler().Get2D();
 }
 
 inline void UpdateProgress(float progress)
@@ -5,6 +5,9 @@
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <future>
+#include <memory>
+#include <stdexcept>
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -12,6 +15,57 @@
 // function().
 int main(int argc, char** argv)
 {
+    // RayTracing [--spp N] [--adaptive ERROR] [--budget SAMPLES] [--time SECONDS]
+    // --adaptive, --budget and --time turn on progressive rendering, where --spp caps the
+    // samples of a pixel. Without --adaptive the default error threshold is used.
+    const char* usage = "Usage: RayTracing [--spp N] [--adaptive ERROR] [--budget SAMPLES] "
+                        "[--time SECONDS]\n";
+    Renderer r;
+    for (int i = 1; i < argc; i += 2)
+    {
+        std::string option = argv[i];
+        if (i + 1 == argc)
+        {
+            std::cerr << "Missing value for " << option << "\n" << usage;
+            return 1;
+        }
+        std::string value = argv[i + 1];
+        // Numbers must use up the whole value, so "16x" is an error rather than 16
+        size_t end = value.size();
+        try
+        {
+            if (option == "--spp")
+                r.spp = std::stoi(value, &end);
+            else if (option == "--adaptive")
+            {
+                r.progressive = true;
+                r.errorThreshold = std::stof(value, &end);
+            }
+            else if (option == "--budget")
+            {
+                r.progressive = true;
+                r.sampleBudget = std::stoll(value, &end);
+            }
+            else if (option == "--time")
+            {
+                r.progressive = true;
+                r.timeBudget = std::stod(value, &end);
+            }
+            else
+            {
+                std::cerr << "Unknown option " << option << "\n" << usage;
+                return 1;
+            }
+            if (end != value.size())
+                throw std::invalid_argument(value);
+        }
+        catch (const std::logic_error&)
+        {
+            // std::invalid_argument or std::out_of_range
+            std::cerr << "Invalid value for " << option << ": " << value << "\n" << usage;
+            return 1;
+        }
+    }
 
     // Change the definition here to change resolution
     Scene scene(784, 784);
@@ -25,23 +79,32 @@ int main(int argc, char** argv)
     Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * Vector3f(0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f *Vector3f(0.737f+0.642f,0.737f+0.159f,0.737f)));
     light->Kd = Vector3f(0.65f);
 
-    MeshTriangle floor("../models/cornellbox/floor.obj", white);
-    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white);
-    MeshTriangle left("../models/cornellbox/left.obj", red);
-    MeshTriangle right("../models/cornellbox/right.obj", green);
-    MeshTriangle light_("../models/cornellbox/light.obj", light);
-
-    scene.Add(&floor);
-    scene.Add(&shortbox);
-    scene.Add(&tallbox);
-    scene.Add(&left);
-    scene.Add(&right);
-    scene.Add(&light_);
+    // Every mesh loads its OBJ and builds its BVH, so load them all concurrently
+    std::vector<std::pair<std::string, Material*>> mesh_files = {
+        {"../models/cornellbox/floor.obj", white},
+        {"../models/cornellbox/shortbox.obj", white},
+        {"../models/cornellbox/tallbox.obj", white},
+        {"../models/cornellbox/left.obj", red},
+        {"../models/cornellbox/right.obj", green},
+        {"../models/cornellbox/light.obj", light},
+    };
+    std::vector<std::future<std::unique_ptr<MeshTriangle>>> loads;
+    for (auto& [filename, material] : mesh_files)
+    {
+        loads.emplace_back(std::async(std::launch::async, [&filename = filename, material = material] {
+            return std::make_unique<MeshTriangle>(filename, material);
+        }));
+    }
+    std::vector<std::unique_ptr<MeshTriangle>> meshes;
+    for (size_t i = 0; i < loads.size(); ++i)
+    {
+        meshes.push_back(loads[i].get());
+        scene.Add(meshes.back().get());
+        std::cout << "BVH " << mesh_files[i].first << ": " << meshes.back()->bvh->Stats() << "\n";
+    }
 
     scene.buildBVH();
-
-    Renderer r;
+    std::cout << "BVH scene: " << scene.bvh->Stats() << "\n\n";
 
     auto start = std::chrono::system_clock::now();
     r.Render(scene);